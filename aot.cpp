@@ -0,0 +1,388 @@
+#include "aot.h"
+
+#include <map>
+#include <optional>
+
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/TargetParser/Host.h"
+#include "llvm/TargetParser/SubtargetFeature.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+std::unique_ptr<llvm::TargetMachine> TheTargetMachine;
+
+// Features of the CPU this compiler runs on, for --mcpu=native
+static void addHostFeatures(llvm::SubtargetFeatures &Features) {
+#if LLVM_VERSION_MAJOR >= 19
+    llvm::StringMap<bool> HostFeatures = llvm::sys::getHostCPUFeatures();
+#else
+    llvm::StringMap<bool> HostFeatures;
+    llvm::sys::getHostCPUFeatures(HostFeatures);
+#endif
+    for (auto &Feature: HostFeatures) {
+        Features.AddFeature(Feature.first(), Feature.second);
+    }
+}
+
+llvm::Error InitializeAOT(const std::string &CPU, const std::vector<std::string> &Features) {
+    std::string TargetTriple = llvm::sys::getDefaultTargetTriple();
+    std::string Error;
+    const llvm::Target *Target = llvm::TargetRegistry::lookupTarget(TargetTriple, Error);
+    if (Target == nullptr) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), Error);
+    }
+
+    // Portable by default; --multiversion adds clones for newer CPUs
+    std::string TargetCPU = CPU.empty() ? "generic" : CPU;
+    llvm::SubtargetFeatures TargetFeatures;
+    if (TargetCPU == "native") {
+        TargetCPU = llvm::sys::getHostCPUName().str();
+        addHostFeatures(TargetFeatures);
+    }
+    for (auto &Feature: Features) {
+        TargetFeatures.AddFeature(Feature);
+    }
+
+    llvm::TargetOptions Options;
+    TheTargetMachine.reset(Target->createTargetMachine(TargetTriple, TargetCPU, TargetFeatures.getString(), Options,
+                                                       llvm::Reloc::PIC_,
+                                                       std::nullopt,
+#if LLVM_VERSION_MAJOR >= 18
+                                                       llvm::CodeGenOptLevel::Aggressive
+#else
+                                                       llvm::CodeGenOpt::Aggressive
+#endif
+    ));
+    if (TheTargetMachine == nullptr) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "cannot create target machine for %s",
+                                       TargetTriple.c_str());
+    }
+    return llvm::Error::success();
+}
+
+static bool isSharedLibraryPath(llvm::StringRef Path) {
+    llvm::StringRef Extension = llvm::sys::path::extension(Path);
+    return Extension == ".so" or Extension == ".dylib";
+}
+
+static bool isIRPath(llvm::StringRef Path) {
+    return llvm::sys::path::extension(Path) == ".ll";
+}
+
+static llvm::Error WriteIRFile(const llvm::Module &M, llvm::StringRef Path) {
+    std::error_code EC;
+    llvm::raw_fd_ostream Out(Path, EC, llvm::sys::fs::OF_Text);
+    if (EC) {
+        return llvm::createFileError(Path, EC);
+    }
+    M.print(Out, nullptr);
+    Out.close();
+    if (Out.has_error()) {
+        EC = Out.error();
+        Out.clear_error();
+        return llvm::createFileError(Path, EC);
+    }
+    return llvm::Error::success();
+}
+
+static llvm::Error WriteObjectFile(llvm::Module &M, llvm::StringRef Path) {
+    std::error_code EC;
+    llvm::raw_fd_ostream Out(Path, EC, llvm::sys::fs::OF_None);
+    if (EC) {
+        return llvm::createFileError(Path, EC);
+    }
+
+    llvm::legacy::PassManager PM;
+#if LLVM_VERSION_MAJOR >= 18
+    auto FileType = llvm::CodeGenFileType::ObjectFile;
+#else
+    auto FileType = llvm::CGFT_ObjectFile;
+#endif
+    if (TheTargetMachine->addPassesToEmitFile(PM, Out, nullptr, FileType)) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "target cannot emit object files");
+    }
+    PM.run(M);
+    // A full disk only shows when the buffer is written out
+    Out.close();
+    if (Out.has_error()) {
+        EC = Out.error();
+        Out.clear_error();
+        return llvm::createFileError(Path, EC);
+    }
+    return llvm::Error::success();
+}
+
+static llvm::Error LinkSharedLibrary(llvm::StringRef ObjectPath, const std::string &OutputPath,
+                                     const std::string &LinkerPath, const std::string &RuntimePath) {
+    auto Linker = llvm::sys::findProgramByName(LinkerPath);
+    if (!Linker) {
+        return llvm::createStringError(Linker.getError(), "cannot find linker '%s'", LinkerPath.c_str());
+    }
+
+    std::vector<llvm::StringRef> Arguments = {*Linker, "-shared", "-o", OutputPath, ObjectPath};
+    if (RuntimePath.empty() == false) {
+        Arguments.push_back(RuntimePath);
+    }
+    Arguments.push_back("-lm");
+
+    std::string ErrorMessage;
+    if (llvm::sys::ExecuteAndWait(*Linker, Arguments, std::nullopt, {}, 0, 0, &ErrorMessage) != 0) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "linking %s failed %s", OutputPath.c_str(),
+                                       ErrorMessage.c_str());
+    }
+    return llvm::Error::success();
+}
+
+llvm::Error EmitObject(llvm::Module &M, const std::string &OutputPath,
+                       const std::string &LinkerPath, const std::string &RuntimePath) {
+#if LLVM_VERSION_MAJOR >= 21
+    M.setTargetTriple(TheTargetMachine->getTargetTriple());
+#else
+    M.setTargetTriple(TheTargetMachine->getTargetTriple().str());
+#endif
+    M.setDataLayout(TheTargetMachine->createDataLayout());
+    if (llvm::verifyModule(M, &llvm::errs())) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "module is broken");
+    }
+
+    if (isIRPath(OutputPath)) {
+        return WriteIRFile(M, OutputPath);
+    }
+    if (isSharedLibraryPath(OutputPath) == false) {
+        return WriteObjectFile(M, OutputPath);
+    }
+
+    llvm::SmallString<128> ObjectPath;
+    if (auto EC = llvm::sys::fs::createTemporaryFile("kaleidoscope", "o", ObjectPath)) {
+        return llvm::createFileError(ObjectPath, EC);
+    }
+    llvm::FileRemover RemoveObject(ObjectPath);
+
+    if (auto Error = WriteObjectFile(M, ObjectPath)) {
+        return Error;
+    }
+    return LinkSharedLibrary(ObjectPath, OutputPath, LinkerPath, RuntimePath);
+}
+
+static bool hasVectorSignature(const llvm::Function &F) {
+    if (F.getReturnType()->isVectorTy()) {
+        return true;
+    }
+    for (const llvm::Argument &Argument: F.args()) {
+        if (Argument.getType()->isVectorTy()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void AddPointerEntryPoints(llvm::Module &M) {
+    std::vector<llvm::Function *> Functions;
+    for (llvm::Function &F: M) {
+        if (F.isDeclaration() == false and F.hasLocalLinkage() == false and hasVectorSignature(F)) {
+            Functions.push_back(&F);
+        }
+    }
+
+    llvm::LLVMContext &Context = M.getContext();
+    llvm::Type *PointerType = llvm::PointerType::getUnqual(Context);
+    for (llvm::Function *F: Functions) {
+        std::vector<llvm::Type *> Parameters;
+        for (llvm::Argument &Argument: F->args()) {
+            Parameters.push_back(Argument.getType()->isVectorTy() ? PointerType : Argument.getType());
+        }
+        bool VectorResult = F->getReturnType()->isVectorTy();
+        if (VectorResult) {
+            Parameters.push_back(PointerType);
+        }
+        auto *Entry = llvm::Function::Create(
+            llvm::FunctionType::get(VectorResult ? llvm::Type::getVoidTy(Context) : F->getReturnType(), Parameters,
+                                    false),
+            llvm::Function::ExternalLinkage, F->getName() + "_p", M);
+
+        // Lanes are read from and written to plain double arrays: only 8 byte alignment
+        llvm::IRBuilder<> Builder(llvm::BasicBlock::Create(Context, "entry", Entry));
+        std::vector<llvm::Value *> Arguments;
+        for (llvm::Argument &Argument: F->args()) {
+            llvm::Argument *Parameter = Entry->getArg(Argument.getArgNo());
+            Parameter->setName(Argument.getName());
+            if (Argument.getType()->isVectorTy()) {
+                Parameter->addAttr(llvm::Attribute::ReadOnly);
+                Arguments.push_back(Builder.CreateAlignedLoad(Argument.getType(), Parameter, llvm::Align(8)));
+            } else {
+                Arguments.push_back(Parameter);
+            }
+        }
+        // Not named "result": the output array argument takes that name, for the header
+        llvm::Value *Result = Builder.CreateCall(F, Arguments);
+        if (VectorResult) {
+            llvm::Argument *Output = Entry->getArg(Entry->arg_size() - 1);
+            Output->setName("result");
+            Output->addAttr(llvm::Attribute::WriteOnly);
+            Builder.CreateAlignedStore(Result, Output, llvm::Align(8));
+            Builder.CreateRetVoid();
+        } else {
+            Builder.CreateRet(Result);
+        }
+        llvm::verifyFunction(*Entry);
+    }
+}
+
+// Arrays of lanes are `const double *` when only read, the result array `double *`
+static std::string getCType(const llvm::Argument &Argument) {
+    if (Argument.getType()->isPointerTy()) {
+        return Argument.onlyReadsMemory() ? "const double *" : "double *";
+    }
+    return "double ";
+}
+
+llvm::Error EmitHeader(const llvm::Module &M, const std::string &HeaderPath) {
+    std::error_code EC;
+    llvm::raw_fd_ostream Out(HeaderPath, EC, llvm::sys::fs::OF_Text);
+    if (EC) {
+        return llvm::createFileError(HeaderPath, EC);
+    }
+
+    // Include guard from the file name: kernels.h -> KERNELS_H
+    std::string Guard;
+    for (char C: llvm::sys::path::filename(HeaderPath)) {
+        Guard.push_back(isalnum(static_cast<unsigned char>(C)) ? toupper(C) : '_');
+    }
+
+    Out << "// Generated by the Kaleidoscope compiler\n";
+    Out << "#ifndef " << Guard << "\n#define " << Guard << "\n\n";
+    Out << "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+    // Functions with vecN values are declared as their <name>_p entry point, which takes arrays of lanes
+    for (const llvm::Function &F: M) {
+        if (F.isDeclaration() or F.hasLocalLinkage() or hasVectorSignature(F)) {
+            continue;
+        }
+        Out << (F.getReturnType()->isVoidTy() ? "void" : "double") << " " << F.getName() << "(";
+        for (const llvm::Argument &Argument: F.args()) {
+            if (Argument.getArgNo() != 0) {
+                Out << ", ";
+            }
+            Out << getCType(Argument) << Argument.getName();
+        }
+        if (F.arg_empty()) {
+            Out << "void";
+        }
+        Out << ");\n";
+    }
+    Out << "\n#ifdef __cplusplus\n}\n#endif\n\n#endif\n";
+    return llvm::Error::success();
+}
+
+// x86-64 micro-architecture levels with their kal_cpu_level() value; the baseline keeps the module's CPU
+struct FunctionVersion {
+    unsigned int Level;
+    const char *CPU;
+    const char *Suffix;
+};
+
+static const FunctionVersion FunctionVersions[] = {
+    {1, nullptr, "baseline"},
+    {2, "x86-64-v2", "x86_64_v2"},
+    {3, "x86-64-v3", "x86_64_v3"},
+    {4, "x86-64-v4", "x86_64_v4"},
+};
+
+void MultiversionFunctions(llvm::Module &M) {
+    if (TheTargetMachine->getTargetTriple().getArch() != llvm::Triple::x86_64) {
+        return;
+    }
+
+    std::vector<llvm::Function *> Functions;
+    for (llvm::Function &F: M) {
+        if (F.isDeclaration() == false) {
+            Functions.push_back(&F);
+        }
+    }
+    if (Functions.empty()) {
+        return;
+    }
+
+    // Clones of one level call each other directly, so they can be inlined into each other
+    std::map<llvm::Function *, std::vector<llvm::Function *> > Versions;
+    for (auto &Version: FunctionVersions) {
+        llvm::ValueToValueMapTy VMap;
+        for (llvm::Function *F: Functions) {
+            auto *Clone = llvm::Function::Create(F->getFunctionType(), llvm::Function::InternalLinkage,
+                                                 F->getName() + "." + Version.Suffix, M);
+            VMap[F] = Clone;
+            Versions[F].push_back(Clone);
+        }
+        for (llvm::Function *F: Functions) {
+            auto *Clone = llvm::cast<llvm::Function>(VMap[F]);
+            auto CloneArgument = Clone->arg_begin();
+            for (llvm::Argument &Argument: F->args()) {
+                CloneArgument->setName(Argument.getName());
+                VMap[&Argument] = &*CloneArgument++;
+            }
+            llvm::SmallVector<llvm::ReturnInst *, 4> Returns;
+            llvm::CloneFunctionInto(Clone, F, VMap, llvm::CloneFunctionChangeType::LocalChangesOnly, Returns);
+            Clone->setLinkage(llvm::Function::InternalLinkage);
+            Clone->setVisibility(llvm::GlobalValue::DefaultVisibility);
+            if (Version.CPU != nullptr) {
+                Clone->addFnAttr("target-cpu", Version.CPU);
+            }
+        }
+    }
+
+    llvm::LLVMContext &Context = M.getContext();
+    llvm::Type *PointerType = llvm::PointerType::getUnqual(Context);
+    llvm::FunctionCallee CPULevel = M.getOrInsertFunction(
+        "kal_cpu_level", llvm::FunctionType::get(llvm::Type::getInt32Ty(Context), false));
+
+    // Load time: point every function at the best version for this CPU
+    auto *Select = llvm::Function::Create(llvm::FunctionType::get(llvm::Type::getVoidTy(Context), false),
+                                          llvm::Function::InternalLinkage, "kal.select_versions", M);
+    llvm::IRBuilder<> SelectBuilder(llvm::BasicBlock::Create(Context, "entry", Select));
+    llvm::Value *Level = SelectBuilder.CreateCall(CPULevel, {}, "level");
+
+    for (llvm::Function *F: Functions) {
+        // Local functions are only called from other functions, which now call their clones. Vectors are passed
+        // in other registers once AVX is enabled, so a stub for the baseline could not jump to a v3 or v4 clone
+        // with them: functions with vecN values keep their baseline body (C calls their _p entry point anyway).
+        if (F->hasLocalLinkage() or hasVectorSignature(*F)) {
+            continue;
+        }
+        auto &FunctionClones = Versions[F];
+        auto *Pointer = new llvm::GlobalVariable(M, PointerType, false, llvm::GlobalValue::InternalLinkage,
+                                                 FunctionClones[0], F->getName() + ".version");
+        llvm::Value *Chosen = FunctionClones[0];
+        for (size_t i = 1; i < FunctionClones.size(); ++i) {
+            llvm::Value *Supported = SelectBuilder.CreateICmpUGE(Level, SelectBuilder.getInt32(FunctionVersions[i].Level));
+            Chosen = SelectBuilder.CreateSelect(Supported, FunctionClones[i], Chosen);
+        }
+        SelectBuilder.CreateStore(Chosen, Pointer);
+
+        // The exported function becomes a stub that jumps to the chosen version
+        F->deleteBody();
+        F->setMemoryEffects(llvm::MemoryEffects::unknown());
+        llvm::IRBuilder<> StubBuilder(llvm::BasicBlock::Create(Context, "entry", F));
+        llvm::Value *Target = StubBuilder.CreateLoad(PointerType, Pointer, "version");
+        std::vector<llvm::Value *> Arguments;
+        for (llvm::Argument &Argument: F->args()) {
+            Arguments.push_back(&Argument);
+        }
+        llvm::CallInst *Call = StubBuilder.CreateCall(F->getFunctionType(), Target, Arguments);
+        Call->setCallingConv(F->getCallingConv());
+        Call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+        StubBuilder.CreateRet(Call);
+    }
+    SelectBuilder.CreateRetVoid();
+    // Priorities below 101 are reserved for the implementation; this one runs with the default constructors
+    llvm::appendToGlobalCtors(M, Select, 65535);
+}
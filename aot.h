@@ -0,0 +1,46 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Target/TargetMachine.h"
+
+// Ahead-of-time compilation: the whole script goes into one module that is written out at EOF
+
+extern std::unique_ptr<llvm::TargetMachine> TheTargetMachine; // Only set in AOT mode
+
+inline bool isAOT() {
+    return TheTargetMachine != nullptr;
+}
+
+// Create TheTargetMachine for the host triple (position independent code so the object can go into a shared library).
+// CPU is "generic" when empty, "native" for this machine; Features ("+avx2", ...) are applied on top.
+llvm::Error InitializeAOT(const std::string &CPU = "", const std::vector<std::string> &Features = {});
+
+// Replace every function defined in M by a stub that calls the clone for the best x86-64 level
+// (baseline, v2, v3, v4) of the running CPU, chosen once at load time with kal_cpu_level().
+// Functions with vecN arguments or result stay baseline code (their vector registers differ between
+// levels); the clones call each other's clones of them directly. Nothing happens for other targets.
+// Run after AddPointerEntryPoints and before optimization, so each clone is optimized for its level.
+void MultiversionFunctions(llvm::Module &M);
+
+// C callers cannot pass vecN values the way M does: a generic x86-64 passes `<4 x double>` in two SSE registers,
+// C compiled with -mavx in one AVX register. Give every exported function with vecN arguments or result an
+// entry point `<name>_p` that takes them through memory instead: a vecN argument as `const double *` to its
+// lanes, and a vecN result written to a last `double *` argument (the entry point returns void).
+void AddPointerEntryPoints(llvm::Module &M);
+
+// Write M (already optimized) to OutputPath: a shared library if the path ends in .so/.dylib, LLVM IR text if it
+// ends in .ll, otherwise an object file. The shared library is linked with RuntimePath (library.cpp) by LinkerPath.
+llvm::Error EmitObject(llvm::Module &M, const std::string &OutputPath,
+                       const std::string &LinkerPath, const std::string &RuntimePath);
+
+// Write a C header with the `double f(double, ...)` prototype of every function defined in M, and of the
+// pointer entry points instead of functions with vecN values
+llvm::Error EmitHeader(const llvm::Module &M, const std::string &HeaderPath);
+
+#endif
@@ -2,6 +2,7 @@
 #define AST_H
 
 #include <iostream>
+#include <map>
 #include <memory>
 #include <vector>
 #include <string>
@@ -9,13 +10,67 @@
 #include <llvm/IR/Value.h>
 
 namespace ASTNode {
+    // Floating-point semantics of a function body
+    enum class FloatingPointMode {
+        Default, // use the global --fp-mode
+        Strict, // IEEE semantics
+        Contract, // allow fusing a * b + c into fma
+        Fast, // all fast-math flags: reassociation, no NaN/Inf, ...
+    };
+
+    // Qualifiers between `def` and the function name, e.g. `def fast dot(a b) ...`
+    struct FunctionQualifiers {
+        FloatingPointMode FPMode = FloatingPointMode::Default;
+        bool Memoize = false; // `memo`: cache results of a pure function
+        bool TopLevel = false; // __anon_expr: a vector result is stored through a pointer argument
+    };
+
+    // How a value is represented in generated code. Every value is a double in the language,
+    // but provably integral values and comparison results don't need to be one.
+    enum class ValueKind {
+        Double, // double
+        Integer, // i64 holding an integral double exactly
+        Boolean, // i1 holding 0.0 or 1.0
+        Vector, // <Lanes x double>, a vec2/vec4/vec8 value
+    };
+
+    struct VariableType {
+        ValueKind Kind;
+        double Min, Max; // Integer: range of the value
+        unsigned int Lanes = 0; // Vector: 2, 4 or 8
+        bool Assumed = false; // Integer: the range relies on the assumed loop trip count, so arithmetic may wrap
+    };
+
+    using TypeEnvironment = std::map<std::string, VariableType>; // Variables in scope
+
+    // vec2(...), lane(v, i), hsum(v), ...: calls that are generated inline instead of calling a function
+    bool isVectorBuiltin(const std::string &Name);
+
     class ExpressionASTNode {
+    protected:
+        VariableType Type = {ValueKind::Double, 0, 0}; // Set by inferTypes
+
     public:
         virtual ~ExpressionASTNode() = default;
 
+        const VariableType &getType() const { return Type; }
+
+        ValueKind getKind() const { return Type.Kind; }
+
+        // Type inference: decide the kind of this node and its children, before codegen
+        virtual void inferTypes(TypeEnvironment &Environment) = 0;
+
         // pure virtual
         // llvm::Value - constant, instruction, function, argument, global variable, block
+        // The value has the LLVM type of getKind()
         virtual llvm::Value *codegen() = 0;
+
+        // codegen() converted to another kind; Boolean tests for != 0.0, Vector splats a number over Lanes
+        llvm::Value *codegenAs(ValueKind Target, unsigned int Lanes = 0);
+
+        // Generate the expression in tail position and return its value from the current function
+        // false on error
+        virtual bool codegenTail();
     };
 
     class NumberExpressionASTNode : public ExpressionASTNode {
@@ -25,6 +80,10 @@ namespace ASTNode {
         NumberExpressionASTNode(double value) : value(value) {
         }
 
+        double getValue() const { return value; }
+
+        void inferTypes(TypeEnvironment &Environment) override;
+
         llvm::Value *codegen() override;
     };
 
@@ -36,6 +95,10 @@ namespace ASTNode {
             this->Name = Name;
         }
 
+        const std::string &getName() const { return Name; }
+
+        void inferTypes(TypeEnvironment &Environment) override;
+
         llvm::Value *codegen() override;
     };
 
@@ -51,6 +114,14 @@ namespace ASTNode {
             this->RHS = std::move(RHS);
         }
 
+        char getOperator() const { return Operator; }
+
+        const ExpressionASTNode &getLHS() const { return *LHS; }
+
+        const ExpressionASTNode &getRHS() const { return *RHS; }
+
+        void inferTypes(TypeEnvironment &Environment) override;
+
         llvm::Value *codegen() override;
     };
 
@@ -65,7 +136,14 @@ namespace ASTNode {
             this->Arguments = std::move(Arguments);
         }
 
+        void inferTypes(TypeEnvironment &Environment) override;
+
         llvm::Value *codegen() override;
+
+        bool codegenTail() override;
+
+    private:
+        llvm::Value *codegenVectorBuiltin();
     };
 
     class IfExpressionASTNode : public ExpressionASTNode {
@@ -78,12 +156,18 @@ namespace ASTNode {
                                                                        Then(std::move(Then)), Else(std::move(Else)) {
         }
 
+        void inferTypes(TypeEnvironment &Environment) override;
+
         llvm::Value *codegen() override;
+
+        bool codegenTail() override;
     };
 
     class ForExpressionASTNode : public ExpressionASTNode {
         std::string VariableName;
         std::unique_ptr<ExpressionASTNode> Start, End, Step, Body;
+        ValueKind CounterKind = ValueKind::Double; // Set by inferTypes
+        bool CounterAssumed = false; // Set by inferTypes: the counter range relies on the assumed trip count
 
     public:
         ForExpressionASTNode(const std::string &VariableName,
@@ -98,35 +182,85 @@ namespace ASTNode {
             Body(std::move(Body)) {
         }
 
+        void inferTypes(TypeEnvironment &Environment) override;
+
         llvm::Value *codegen() override;
     };
 
     class SignatureASTNode {
         std::string Name;
         std::vector<std::string> Arguments;
+        std::vector<unsigned int> ArgumentLanes; // 0 for a number, 2/4/8 for `a:vec2` ...
+        unsigned int ReturnLanes = 0;
+        bool Pure = false; // Inferred for definitions: result depends only on the arguments
+        bool AlwaysReturns = false; // Pure and known to terminate
+        bool HiddenState = false; // Pure, but writes state callers cannot see: a memo cache, its own or a callee's
+        bool Extern = false; // Declared with `extern`, not defined in Kaleidoscope
 
     public:
-        SignatureASTNode(const std::string &Name, std::vector<std::string> Arguments) {
+        SignatureASTNode(const std::string &Name, std::vector<std::string> Arguments,
+                         std::vector<unsigned int> ArgumentLanes = {}, unsigned int ReturnLanes = 0) {
             this->Name = Name;
             this->Arguments = std::move(Arguments);
+            this->ArgumentLanes = std::move(ArgumentLanes);
+            this->ArgumentLanes.resize(this->Arguments.size(), 0);
+            this->ReturnLanes = ReturnLanes;
         }
 
         llvm::Function *codegen();
 
         const std::string &getName() const { return Name; }
+
+        const std::vector<std::string> &getArguments() const { return Arguments; }
+
+        const std::vector<unsigned int> &getArgumentLanes() const { return ArgumentLanes; }
+
+        unsigned int getReturnLanes() const { return ReturnLanes; }
+
+        void setReturnLanes(unsigned int Lanes) { ReturnLanes = Lanes; }
+
+        bool hasVectors() const {
+            for (unsigned int Lanes: ArgumentLanes) {
+                if (Lanes != 0) {
+                    return true;
+                }
+            }
+            return ReturnLanes != 0;
+        }
+
+        bool isExtern() const { return Extern; }
+
+        void setExtern() { Extern = true; }
+
+        bool isPure() const { return Pure; }
+
+        bool alwaysReturns() const { return AlwaysReturns; }
+
+        bool hasHiddenState() const { return HiddenState; }
+
+        void setPurity(bool Pure, bool AlwaysReturns, bool HiddenState = false) {
+            this->Pure = Pure;
+            this->AlwaysReturns = Pure and AlwaysReturns;
+            this->HiddenState = Pure and HiddenState;
+        }
     };
 
     class FunctionASTNode {
         std::unique_ptr<SignatureASTNode> Signature;
         std::unique_ptr<ExpressionASTNode> Body;
+        FunctionQualifiers Qualifiers;
 
     public:
         FunctionASTNode(std::unique_ptr<SignatureASTNode> Signature,
-                        std::unique_ptr<ExpressionASTNode> Body) {
+                        std::unique_ptr<ExpressionASTNode> Body,
+                        FunctionQualifiers Qualifiers = FunctionQualifiers()) {
             this->Signature = std::move(Signature);
             this->Body = std::move(Body);
+            this->Qualifiers = Qualifiers;
         }
 
+        const std::string &getName() const { return Signature->getName(); }
+
         llvm::Function *codegen();
     };
 }
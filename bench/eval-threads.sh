@@ -0,0 +1,29 @@
+#!/bin/sh
+# Wall-clock time of a script of independent pure expressions, on the main thread and with --eval-threads,
+# which compiles and calls them on worker threads while the next ones are compiled:
+#   ../bench/eval-threads.sh ./main [threads] [expressions]
+
+Main=${1:-./main}
+Threads=${2:-4}
+Count=${3:-200}
+Script=$(mktemp)
+trap 'rm -f "$Script"' EXIT
+
+{
+    echo 'def work(n s) if n < 1 then s else work(n - 1, s + n * 0.5);'
+    i=0
+    while [ $i -lt "$Count" ]; do
+        echo "work(2000000 + $i, 0);"
+        i=$((i + 1))
+    done
+} > "$Script"
+
+run() {
+    Start=$(date +%s%N)
+    "$Main" "$@" < "$Script" > /dev/null 2>&1 || { echo "Error: $Main $* failed" >&2; exit 1; }
+    End=$(date +%s%N)
+    echo "$(((End - Start) / 1000000)) ms"
+}
+
+echo "$Count expressions, main thread: $(run)"
+echo "$Count expressions, --eval-threads=$Threads: $(run --eval-threads="$Threads")"
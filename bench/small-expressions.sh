@@ -0,0 +1,60 @@
+#!/bin/sh
+# Time of many small top-level expressions, each one compiled, linked against the runtime functions and a
+# definition, looked up and run. Most of it is spent in the JIT, not in the code, so this measures symbol
+# resolution and lookup. Give it two builds (e.g. before and after a change) to compare them on the same script;
+# each one runs Runs times and the best time counts:
+#   ../bench/small-expressions.sh ./main [./main-before ...] [expressions]
+
+Count=5000
+Runs=${RUNS:-3}
+Mains=""
+for Argument in "$@"; do
+    case $Argument in
+        *[!0-9]*) Mains="$Mains $Argument" ;;
+        *) Count=$Argument ;;
+    esac
+done
+Mains=${Mains:-./main}
+
+Script=$(mktemp)
+trap 'rm -f "$Script"' EXIT
+
+{
+    echo 'extern outd(x);'
+    echo 'extern printd(x);'
+    echo 'def f(x) x * 2 + 1;'
+    i=0
+    while [ $i -lt "$Count" ]; do
+        echo "outd(f($i)) + printd($i);"
+        i=$((i + 1))
+    done
+} > "$Script"
+
+# Best wall-clock time of $1 over Runs runs, in microseconds
+best() {
+    Best=""
+    Run=0
+    while [ $Run -lt "$Runs" ]; do
+        Start=$(date +%s%N)
+        "$1" < "$Script" > /dev/null 2>&1 || { echo "Error: $1 failed" >&2; exit 1; }
+        End=$(date +%s%N)
+        Elapsed=$(((End - Start) / 1000))
+        if [ -z "$Best" ] || [ $Elapsed -lt "$Best" ]; then
+            Best=$Elapsed
+        fi
+        Run=$((Run + 1))
+    done
+    echo "$Best"
+}
+
+First=""
+for Main in $Mains; do
+    Elapsed=$(best "$Main") || exit 1
+    Line="$Main: $Count expressions in $((Elapsed / 1000)) ms, $((Elapsed / Count)) us per expression"
+    if [ -z "$First" ]; then
+        First=$Elapsed
+    else
+        Line="$Line, $((Elapsed * 100 / First))% of the first"
+    fi
+    echo "$Line"
+done
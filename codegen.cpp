@@ -1,6 +1,10 @@
 #include "codegen.h"
 #include "ast.h"
 #include "parser.h"
+#include "library.h"
+#include "aot.h"
+#include "purity.h"
+#include "irimport.h"
 
 
 std::unique_ptr<llvm::LLVMContext> TheContext; // Tool set
@@ -28,12 +32,42 @@ std::map<std::string, std::unique_ptr<ASTNode::SignatureASTNode> > Signatures;
 
 llvm::ExitOnError ExitOnErr;
 
+ASTNode::FloatingPointMode DefaultFloatingPointMode = ASTNode::FloatingPointMode::Strict;
+
+llvm::OptimizationLevel DefinitionOptimizationLevel = llvm::OptimizationLevel::O2;
+llvm::OptimizationLevel ExpressionOptimizationLevel = llvm::OptimizationLevel::O1;
+
+llvm::TargetMachine *getTargetMachine() {
+    return isAOT() ? TheTargetMachine.get() : TheJit->getTargetMachine();
+}
+
+// glibc's libmvec (_ZGVdN4v_sin, ...). The JIT resolves it in the process running the code, so it must be
+// loaded there first; shared libraries get it through libm's linker script.
+static bool useVectorMathLibrary(const llvm::Triple &TT) {
+    if (TT.getArch() != llvm::Triple::x86_64 or TT.isOSGlibc() == false) {
+        return false;
+    }
+    if (isAOT()) {
+        return true;
+    }
+    if (TheJit->isRemote()) {
+        return TheJit->hasExecutorVectorMath();
+    }
+    static bool Loaded = llvm::sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1") == false;
+    return Loaded;
+}
+
 void InitializeModuleAndManagers() {
     // Context, Builder, Module
     TheContext = std::make_unique<llvm::LLVMContext>();
     Builder = std::make_unique<llvm::IRBuilder<> >(*TheContext);
     TheModule = std::make_unique<llvm::Module>("JIT", *TheContext);
-    TheModule->setDataLayout(TheJit->getDataLayout());
+    TheModule->setDataLayout(isAOT() ? TheTargetMachine->createDataLayout() : TheJit->getDataLayout());
+#if LLVM_VERSION_MAJOR >= 21
+    TheModule->setTargetTriple(getTargetMachine()->getTargetTriple());
+#else
+    TheModule->setTargetTriple(getTargetMachine()->getTargetTriple().str());
+#endif
 
     // Manager
     TheFPM = std::make_unique<llvm::FunctionPassManager>();
@@ -45,18 +79,86 @@ void InitializeModuleAndManagers() {
     TheSI = std::make_unique<llvm::StandardInstrumentations>(*TheContext, true);
     TheSI->registerCallbacks(*ThePIC, TheMAM.get());
 
-    // Add transform passes
-    TheFPM->addPass(llvm::InstCombinePass());
-    TheFPM->addPass(llvm::ReassociatePass());
-    TheFPM->addPass(llvm::GVNPass());
-    TheFPM->addPass(llvm::SimplifyCFGPass());
+    // Vector variants of math functions for the loop vectorizer
+    llvm::TargetLibraryInfoImpl TLII(getTargetMachine()->getTargetTriple());
+    if (useVectorMathLibrary(getTargetMachine()->getTargetTriple())) {
+        TLII.addVectorizableFunctionsFromVecLib(llvm::TargetLibraryInfoImpl::LIBMVEC_X86,
+                                                getTargetMachine()->getTargetTriple());
+    }
+    TheFAM->registerPass([TLII] { return llvm::TargetLibraryAnalysis(TLII); });
+
+    // Add transform passes. Only what the front end needs before a definition is registered:
+    // everything else is in the module pipeline of OptimizeModule.
+    // Safepoints will poll in every definition
+    TheFPM->addPass(PurityInferencePass(isAOT() == false and TheJit->hasSafepoints()));
 
-    llvm::PassBuilder PB;
+    llvm::PassBuilder PB(getTargetMachine());
     PB.registerModuleAnalyses(*TheMAM);
+    PB.registerCGSCCAnalyses(*TheCGAM);
     PB.registerFunctionAnalyses(*TheFAM);
+    PB.registerLoopAnalyses(*TheLAM);
     PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
 }
 
+std::optional<llvm::OptimizationLevel> parseOptimizationLevel(char Level) {
+    switch (Level) {
+        case '0':
+            return llvm::OptimizationLevel::O0;
+        case '1':
+            return llvm::OptimizationLevel::O1;
+        case '2':
+            return llvm::OptimizationLevel::O2;
+        case '3':
+            return llvm::OptimizationLevel::O3;
+        case 's':
+            return llvm::OptimizationLevel::Os;
+        case 'z':
+            return llvm::OptimizationLevel::Oz;
+        default:
+            return std::nullopt;
+    }
+}
+
+void OptimizeModule(llvm::OptimizationLevel Level) {
+    llvm::PassBuilder PB(getTargetMachine());
+    // Self recursion in tail position must become a loop at every level: only -O2 and up have TailCallElimPass.
+    // -O1 gets it with the peephole passes of its function simplification, -O0 after its few passes.
+    if (Level == llvm::OptimizationLevel::O1) {
+        PB.registerPeepholeEPCallback([](llvm::FunctionPassManager &FPM, llvm::OptimizationLevel) {
+            FPM.addPass(llvm::TailCallElimPass());
+        });
+    }
+    llvm::ModulePassManager MPM = Level == llvm::OptimizationLevel::O0
+                                      ? PB.buildO0DefaultPipeline(Level)
+                                      : PB.buildPerModuleDefaultPipeline(Level);
+    if (Level == llvm::OptimizationLevel::O0) {
+        MPM.addPass(llvm::createModuleToFunctionPassAdaptor(llvm::TailCallElimPass()));
+    }
+    MPM.run(*TheModule, *TheMAM);
+}
+
+llvm::Function *codegenExpressionMain(llvm::Function *Expression, unsigned int Lanes) {
+    auto *Main = llvm::Function::Create(
+        llvm::FunctionType::get(Builder->getInt32Ty(), {Builder->getInt32Ty(), Builder->getPtrTy()}, false),
+        llvm::Function::ExternalLinkage, Expression->getName() + ".main", TheModule.get());
+    Builder->SetInsertPoint(llvm::BasicBlock::Create(*TheContext, "entry", Main));
+
+    llvm::AllocaInst *Result = Builder->CreateAlloca(Builder->getDoubleTy(), Builder->getInt32(std::max(Lanes, 1u)),
+                                                     "result");
+    if (Lanes == 0) {
+        Builder->CreateStore(Builder->CreateCall(Expression, {}, "value"), Result);
+    } else {
+        Builder->CreateCall(Expression, {Result});
+    }
+    llvm::FunctionCallee Print = TheModule->getOrInsertFunction(
+        "kal_print_result",
+        llvm::FunctionType::get(Builder->getVoidTy(), {Builder->getPtrTy(), Builder->getInt64Ty()}, false));
+    Builder->CreateCall(Print, {Result, Builder->getInt64(Lanes)});
+    Builder->CreateRet(Builder->getInt32(0));
+    llvm::verifyFunction(*Main);
+    return Main;
+}
+
 llvm::Value *LogErrorV(const char *str) {
     LogError(str);
     return nullptr;
@@ -64,17 +166,93 @@ llvm::Value *LogErrorV(const char *str) {
 
 llvm::Function *getFunction(std::string Name) {
     auto *Function = TheModule->getFunction(Name);
-    if (Function != nullptr) {
-        return Function;
+    if (Function == nullptr) {
+        auto FI = Signatures.find(Name);
+        if (FI == Signatures.end()) {
+            return nullptr;
+        }
+        Function = FI->second->codegen();
     }
-    auto FI = Signatures.find(Name);
-    if (FI != Signatures.end()) {
-        return FI->second->codegen();
+    // Functions of IR files bring their body along, so calls to them can be inlined
+    if (Function->isDeclaration() and LinkImportedBody(Name)) {
+        return TheModule->getFunction(Name);
     }
-    return nullptr;
+    return Function;
+}
+
+static llvm::Type *getValueType(ASTNode::ValueKind Kind, unsigned int Lanes = 0) {
+    switch (Kind) {
+        case ASTNode::ValueKind::Integer:
+            return Builder->getInt64Ty();
+        case ASTNode::ValueKind::Boolean:
+            return Builder->getInt1Ty();
+        case ASTNode::ValueKind::Vector:
+            return llvm::FixedVectorType::get(Builder->getDoubleTy(), Lanes);
+        default:
+            return Builder->getDoubleTy();
+    }
+}
+
+// Arguments and results: double, or <N x double> for vecN
+static llvm::Type *getLanesType(unsigned int Lanes) {
+    return getValueType(Lanes == 0 ? ASTNode::ValueKind::Double : ASTNode::ValueKind::Vector, Lanes);
+}
+
+// E converted to an argument or result type
+static llvm::Value *codegenAsType(ASTNode::ExpressionASTNode &E, llvm::Type *T) {
+    if (auto *VectorType = llvm::dyn_cast<llvm::FixedVectorType>(T)) {
+        return E.codegenAs(ASTNode::ValueKind::Vector, VectorType->getNumElements());
+    }
+    return E.codegenAs(ASTNode::ValueKind::Double);
+}
+
+llvm::Value *ASTNode::ExpressionASTNode::codegenAs(ValueKind Target, unsigned int Lanes) {
+    if (Target == ValueKind::Vector) {
+        if (Type.Kind == ValueKind::Vector) {
+            if (Type.Lanes != Lanes) {
+                return LogErrorV("vectors of different lengths");
+            }
+            return codegen();
+        }
+        llvm::Value *Scalar = codegenAs(ValueKind::Double);
+        if (Scalar == nullptr) {
+            return nullptr;
+        }
+        return Builder->CreateVectorSplat(Lanes, Scalar, "splat");
+    }
+    if (Type.Kind == ValueKind::Vector) {
+        return LogErrorV("expected a number, got a vector");
+    }
+
+    llvm::Value *V = codegen();
+    if (V == nullptr or Type.Kind == Target) {
+        return V;
+    }
+
+    switch (Target) {
+        case ValueKind::Double:
+            if (Type.Kind == ValueKind::Boolean) {
+                return Builder->CreateUIToFP(V, Builder->getDoubleTy(), "booltmp");
+            }
+            return Builder->CreateSIToFP(V, Builder->getDoubleTy(), "inttmp");
+        case ValueKind::Integer:
+            // Inference only asks for an integer when the value is integral already
+            return Builder->CreateZExt(V, Builder->getInt64Ty(), "booltmp");
+        case ValueKind::Boolean:
+            if (Type.Kind == ValueKind::Integer) {
+                return Builder->CreateICmpNE(V, Builder->getInt64(0), "tobool");
+            }
+            return Builder->CreateFCmpONE(V, llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0)), "tobool");
+        default:
+            break;
+    }
+    return V;
 }
 
 llvm::Value *ASTNode::NumberExpressionASTNode::codegen() {
+    if (Type.Kind == ValueKind::Integer) {
+        return Builder->getInt64(static_cast<int64_t>(value));
+    }
     return llvm::ConstantFP::get(*TheContext, llvm::APFloat(value));
 }
 
@@ -87,29 +265,137 @@ llvm::Value *ASTNode::VariableExpressionASTNode::codegen() {
 }
 
 llvm::Value *ASTNode::BinaryExpressionASTNode::codegen() {
-    llvm::Value *L = LHS->codegen();
-    llvm::Value *R = RHS->codegen();
+    // Elementwise: a number operand is splatted, a comparison gives 0.0/1.0 lanes
+    if (Type.Kind == ValueKind::Vector) {
+        llvm::Value *L = LHS->codegenAs(ValueKind::Vector, Type.Lanes);
+        llvm::Value *R = RHS->codegenAs(ValueKind::Vector, Type.Lanes);
+        if (L == nullptr or R == nullptr) {
+            return nullptr;
+        }
+        switch (Operator) {
+            case '+':
+                return Builder->CreateFAdd(L, R, "addtmp");
+            case '-':
+                return Builder->CreateFSub(L, R, "subtmp");
+            case '*':
+                return Builder->CreateFMul(L, R, "multmp");
+            case '<':
+                return Builder->CreateUIToFP(Builder->CreateFCmpULT(L, R, "cmptmp"), L->getType(), "booltmp");
+            default:
+                return LogErrorV("invalid binary operator");
+        }
+    }
+
+    // Arithmetic is done in the kind of its result, comparisons in i64 when both sides are integral
+    ValueKind OperandKind = Type.Kind;
+    if (Operator == '<') {
+        OperandKind = LHS->getKind() != ValueKind::Double and RHS->getKind() != ValueKind::Double
+                          ? ValueKind::Integer
+                          : ValueKind::Double;
+    }
+    llvm::Value *L = LHS->codegenAs(OperandKind);
+    llvm::Value *R = RHS->codegenAs(OperandKind);
 
     if (L == nullptr or R == nullptr) {
         return nullptr;
     }
 
+    // Inference keeps integer results within 2^53, so they never wrap, unless that range is only assumed
+    if (OperandKind == ValueKind::Integer) {
+        bool NoWrap = Type.Assumed == false;
+        switch (Operator) {
+            case '+':
+                return Builder->CreateAdd(L, R, "addtmp", false, NoWrap);
+            case '-':
+                return Builder->CreateSub(L, R, "subtmp", false, NoWrap);
+            case '*':
+                return Builder->CreateMul(L, R, "multmp", false, NoWrap);
+            case '<':
+                return Builder->CreateICmpSLT(L, R, "cmptmp");
+            default:
+                return LogErrorV("invalid binary operator");
+        }
+    }
+
     switch (Operator) {
         case '+':
             return Builder->CreateFAdd(L, R, "addtmp");
         case '-':
-            return Builder->CreateSub(L, R, "subtmp");
+            return Builder->CreateFSub(L, R, "subtmp");
         case '*':
             return Builder->CreateFMul(L, R, "multmp");
         case '<':
-            L = Builder->CreateFCmpULT(L, R, "cmptmp");
-            return Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*TheContext), "booltmp");
+            return Builder->CreateFCmpULT(L, R, "cmptmp");
         default:
             return LogErrorV("invalid binary operator");
     }
 }
 
+struct MathFunction {
+    const char *Name;
+    unsigned int Arity;
+    llvm::Intrinsic::ID ID;
+};
+
+// libm functions with an LLVM intrinsic: constant folded, hoisted and vectorized like arithmetic
+static const MathFunction MathFunctions[] = {
+    {"sqrt", 1, llvm::Intrinsic::sqrt},
+    {"sin", 1, llvm::Intrinsic::sin},
+    {"cos", 1, llvm::Intrinsic::cos},
+#if LLVM_VERSION_MAJOR >= 19
+    {"tan", 1, llvm::Intrinsic::tan},
+#endif
+    {"exp", 1, llvm::Intrinsic::exp},
+    {"exp2", 1, llvm::Intrinsic::exp2},
+    {"log", 1, llvm::Intrinsic::log},
+    {"log2", 1, llvm::Intrinsic::log2},
+    {"log10", 1, llvm::Intrinsic::log10},
+    {"pow", 2, llvm::Intrinsic::pow},
+    {"fabs", 1, llvm::Intrinsic::fabs},
+    {"fma", 3, llvm::Intrinsic::fma},
+    {"floor", 1, llvm::Intrinsic::floor},
+    {"ceil", 1, llvm::Intrinsic::ceil},
+    {"trunc", 1, llvm::Intrinsic::trunc},
+    {"round", 1, llvm::Intrinsic::round},
+    {"rint", 1, llvm::Intrinsic::rint},
+    {"nearbyint", 1, llvm::Intrinsic::nearbyint},
+    {"copysign", 2, llvm::Intrinsic::copysign},
+    {"fmin", 2, llvm::Intrinsic::minnum},
+    {"fmax", 2, llvm::Intrinsic::maxnum},
+};
+
+// Intrinsic for a call to an `extern` math function, not_intrinsic otherwise (including Kaleidoscope definitions)
+static llvm::Intrinsic::ID getMathIntrinsic(const std::string &Name, size_t Arity) {
+    auto Signature = Signatures.find(Name);
+    if (Signature == Signatures.end() or Signature->second->isExtern() == false or
+        Signature->second->hasVectors()) {
+        return llvm::Intrinsic::not_intrinsic;
+    }
+    for (auto &Function: MathFunctions) {
+        if (Name == Function.Name and Arity == Function.Arity) {
+            return Function.ID;
+        }
+    }
+    return llvm::Intrinsic::not_intrinsic;
+}
+
 llvm::Value *ASTNode::FunctionCallExpressionASTNode::codegen() {
+    if (isVectorBuiltin(Callee)) {
+        return codegenVectorBuiltin();
+    }
+
+    llvm::Intrinsic::ID Intrinsic = getMathIntrinsic(Callee, Arguments.size());
+    if (Intrinsic != llvm::Intrinsic::not_intrinsic) {
+        std::vector<llvm::Value *> ArgumentsVector;
+        for (auto &Argument: Arguments) {
+            ArgumentsVector.push_back(Argument->codegenAs(ValueKind::Double));
+            if (ArgumentsVector.back() == nullptr) {
+                return nullptr;
+            }
+        }
+        return Builder->CreateIntrinsic(Intrinsic, {Builder->getDoubleTy()}, ArgumentsVector, nullptr, "calltmp");
+    }
+
     llvm::Function *CalleeFunction = getFunction(Callee);
 
     if (CalleeFunction == nullptr) {
@@ -123,7 +409,7 @@ llvm::Value *ASTNode::FunctionCallExpressionASTNode::codegen() {
     std::vector<llvm::Value *> ArgumentsVector;
 
     for (unsigned int i = 0, e = Arguments.size(); i != e; ++i) {
-        ArgumentsVector.push_back(Arguments[i]->codegen());
+        ArgumentsVector.push_back(codegenAsType(*Arguments[i], CalleeFunction->getArg(i)->getType()));
         if (ArgumentsVector.back() == nullptr) {
             return nullptr;
         }
@@ -131,15 +417,221 @@ llvm::Value *ASTNode::FunctionCallExpressionASTNode::codegen() {
     return Builder->CreateCall(CalleeFunction, ArgumentsVector, "calltmp");
 }
 
+// Entry block alloca, so a call in a loop does not grow the stack
+static llvm::AllocaInst *createEntryBlockAlloca(llvm::Type *T, const char *Name) {
+    llvm::BasicBlock &Entry = Builder->GetInsertBlock()->getParent()->getEntryBlock();
+    llvm::IRBuilder<> EntryBuilder(&Entry, Entry.begin());
+    return EntryBuilder.CreateAlloca(T, nullptr, Name);
+}
+
+// Lane index as i64: truncated (NaN is 0) and taken modulo the vector length
+static llvm::Value *codegenLaneIndex(ASTNode::ExpressionASTNode &Index, unsigned int Lanes) {
+    llvm::Value *IndexValue;
+    if (Index.getKind() == ASTNode::ValueKind::Integer or Index.getKind() == ASTNode::ValueKind::Boolean) {
+        IndexValue = Index.codegenAs(ASTNode::ValueKind::Integer);
+    } else {
+        IndexValue = Index.codegenAs(ASTNode::ValueKind::Double);
+        if (IndexValue != nullptr) {
+            IndexValue = Builder->CreateIntrinsic(llvm::Intrinsic::fptosi_sat, {Builder->getInt64Ty(), Builder->getDoubleTy()},
+                                                  {IndexValue}, nullptr, "laneindex");
+        }
+    }
+    if (IndexValue == nullptr) {
+        return nullptr;
+    }
+    return Builder->CreateAnd(IndexValue, Builder->getInt64(Lanes - 1), "lane");
+}
+
+llvm::Value *ASTNode::FunctionCallExpressionASTNode::codegenVectorBuiltin() {
+    auto VectorArgument = [&](size_t Index) -> llvm::Value * {
+        if (Arguments[Index]->getKind() != ValueKind::Vector) {
+            return LogErrorV("expected a vector argument");
+        }
+        return Arguments[Index]->codegen();
+    };
+
+    if (Callee == "vec2" or Callee == "vec4" or Callee == "vec8") {
+        if (Arguments.size() == 1) {
+            return Arguments[0]->codegenAs(ValueKind::Vector, Type.Lanes);
+        }
+        if (Arguments.size() != Type.Lanes) {
+            return LogErrorV("vector constructor takes one value or one per lane");
+        }
+        llvm::Value *Result = llvm::PoisonValue::get(getValueType(ValueKind::Vector, Type.Lanes));
+        for (unsigned int i = 0; i < Type.Lanes; ++i) {
+            llvm::Value *Lane = Arguments[i]->codegenAs(ValueKind::Double);
+            if (Lane == nullptr) {
+                return nullptr;
+            }
+            Result = Builder->CreateInsertElement(Result, Lane, Builder->getInt64(i), "vectmp");
+        }
+        return Result;
+    }
+
+    if (Callee == "lane" or Callee == "withlane") {
+        if (Arguments.size() != (Callee == "lane" ? 2 : 3)) {
+            return LogErrorV(Callee == "lane" ? "lane takes a vector and an index" : "withlane takes a vector, an index and a value");
+        }
+        llvm::Value *V = VectorArgument(0);
+        if (V == nullptr) {
+            return nullptr;
+        }
+        llvm::Value *Index = codegenLaneIndex(*Arguments[1], Arguments[0]->getType().Lanes);
+        if (Index == nullptr) {
+            return nullptr;
+        }
+        if (Callee == "lane") {
+            return Builder->CreateExtractElement(V, Index, "lanetmp");
+        }
+        llvm::Value *X = Arguments[2]->codegenAs(ValueKind::Double);
+        if (X == nullptr) {
+            return nullptr;
+        }
+        return Builder->CreateInsertElement(V, X, Index, "withlanetmp");
+    }
+
+    if (Callee == "shuffle") {
+        if (Arguments.size() != 4 and Arguments.size() != 6 and Arguments.size() != 10) {
+            return LogErrorV("shuffle takes two vectors and 2, 4 or 8 lane indices");
+        }
+        unsigned int Lanes = Arguments[0]->getType().Lanes;
+        if (Arguments[1]->getType().Lanes != Lanes) {
+            return LogErrorV("vectors of different lengths");
+        }
+        std::vector<int> Mask;
+        for (size_t i = 2; i < Arguments.size(); ++i) {
+            auto *Index = dynamic_cast<NumberExpressionASTNode *>(Arguments[i].get());
+            if (Index == nullptr or Index->getValue() < 0 or Index->getValue() >= 2 * Lanes or
+                Index->getValue() != static_cast<int>(Index->getValue())) {
+                return LogErrorV("shuffle lane indices must be integer literals below twice the vector length");
+            }
+            Mask.push_back(static_cast<int>(Index->getValue()));
+        }
+        llvm::Value *A = VectorArgument(0);
+        llvm::Value *B = A == nullptr ? nullptr : VectorArgument(1);
+        if (B == nullptr) {
+            return nullptr;
+        }
+        return Builder->CreateShuffleVector(A, B, Mask, "shuffletmp");
+    }
+
+    if (Arguments.size() != 1) {
+        return LogErrorV("expected one vector argument");
+    }
+    llvm::Value *V = VectorArgument(0);
+    if (V == nullptr) {
+        return nullptr;
+    }
+
+    // Ordered unless the fast-math flags of the function allow reassociation
+    if (Callee == "hsum") {
+        return Builder->CreateFAddReduce(llvm::ConstantFP::getNegativeZero(Builder->getDoubleTy()), V);
+    }
+    if (Callee == "hprod") {
+        return Builder->CreateFMulReduce(llvm::ConstantFP::get(Builder->getDoubleTy(), 1.0), V);
+    }
+    if (Callee == "hmin") {
+        return Builder->CreateFPMinReduce(V);
+    }
+    if (Callee == "hmax") {
+        return Builder->CreateFPMaxReduce(V);
+    }
+
+    // printv/outv: the runtime reads the lanes from memory, which works with any vector calling convention
+    llvm::FunctionCallee Print = TheModule->getOrInsertFunction(
+        Callee == "printv" ? "kal_print_vector" : "kal_write_vector",
+        llvm::FunctionType::get(Builder->getDoubleTy(), {Builder->getPtrTy(), Builder->getInt64Ty()}, false));
+    auto *F = llvm::cast<llvm::Function>(Print.getCallee());
+    F->setDoesNotThrow();
+    F->setWillReturn();
+    F->setMemoryEffects(llvm::MemoryEffects::inaccessibleOrArgMemOnly());
+
+    llvm::AllocaInst *Storage = createEntryBlockAlloca(V->getType(), "lanes");
+    Builder->CreateStore(V, Storage);
+    return Builder->CreateCall(Print, {Storage, Builder->getInt64(Arguments[0]->getType().Lanes)}, "calltmp");
+}
+
+bool ASTNode::ExpressionASTNode::codegenTail() {
+    llvm::Value *ReturnValue = codegenAsType(*this, Builder->GetInsertBlock()->getParent()->getReturnType());
+    if (ReturnValue == nullptr) {
+        return false;
+    }
+    Builder->CreateRet(ReturnValue);
+    return true;
+}
+
+// A function defined in Kaleidoscope, whose prototype and calling convention this compiler controls. Externs
+// (C and libm functions, the runtime, forward declarations) and functions loaded from LLVM IR are not.
+static bool isKaleidoscopeDefinition(const std::string &Name) {
+    auto Signature = Signatures.find(Name);
+    return Signature != Signatures.end() and Signature->second->isExtern() == false and
+           isImportedFunction(Name) == false;
+}
+
+// Self recursion is marked tail so TailCallElimPass turns it into a loop.
+// Calls between definitions are musttail when the prototypes match, so mutual recursion runs in constant stack.
+// Anything else only gets tail: the backend may still jump to it, but is not forced to.
+bool ASTNode::FunctionCallExpressionASTNode::codegenTail() {
+    // Results that need converting are not in tail position
+    llvm::Function *Caller = Builder->GetInsertBlock()->getParent();
+    if (isVectorBuiltin(Callee) or getValueType(Type.Kind, Type.Lanes) != Caller->getReturnType()) {
+        return ExpressionASTNode::codegenTail();
+    }
+
+    llvm::Value *ReturnValue = codegen();
+    if (ReturnValue == nullptr) {
+        return false;
+    }
+
+    // Math intrinsics are expanded inline or become libm calls in the backend: leave them alone
+    auto *Call = llvm::dyn_cast<llvm::CallInst>(ReturnValue);
+    if (Call != nullptr and Call->getCalledFunction()->isIntrinsic() == false) {
+        llvm::Function *CalleeFunction = Call->getCalledFunction();
+        if (CalleeFunction != Caller and isKaleidoscopeDefinition(Callee) and
+            CalleeFunction->getFunctionType() == Caller->getFunctionType() and
+            CalleeFunction->getCallingConv() == Caller->getCallingConv()) {
+            Call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+        } else {
+            Call->setTailCallKind(llvm::CallInst::TCK_Tail);
+        }
+    }
+    Builder->CreateRet(ReturnValue);
+    return true;
+}
+
+// i1 for a branch on a value: anything but 0.0 is true. Comparisons are used directly.
+static llvm::Value *codegenCondition(ASTNode::ExpressionASTNode &Condition) {
+    return Condition.codegenAs(ASTNode::ValueKind::Boolean);
+}
+
+// Both branches return directly, so calls in them are in tail position too
+bool ASTNode::IfExpressionASTNode::codegenTail() {
+    llvm::Value *ConditionValue = codegenCondition(*Condition);
+    if (ConditionValue == nullptr) {
+        return false;
+    }
+
+    llvm::Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    llvm::BasicBlock *ThenBB = llvm::BasicBlock::Create(*TheContext, "then", TheFunction);
+    llvm::BasicBlock *ElseBB = llvm::BasicBlock::Create(*TheContext, "else");
+    Builder->CreateCondBr(ConditionValue, ThenBB, ElseBB);
+
+    Builder->SetInsertPoint(ThenBB);
+    if (Then->codegenTail() == false) {
+        return false;
+    }
+
+    TheFunction->insert(TheFunction->end(), ElseBB);
+    Builder->SetInsertPoint(ElseBB);
+    return Else->codegenTail();
+}
+
 llvm::Value *ASTNode::IfExpressionASTNode::codegen() {
-    llvm::Value *ConditionValue = Condition->codegen();
+    llvm::Value *ConditionValue = codegenCondition(*Condition);
     if (ConditionValue == nullptr) {
         return nullptr;
     }
 
-    ConditionValue = Builder->CreateFCmpONE(ConditionValue, llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0)),
-                                            "ifcond");
-
     // Create Then, Else, Continue Blocks
     llvm::Function *TheFunction = Builder->GetInsertBlock()->getParent();
     llvm::BasicBlock *ThenBB = llvm::BasicBlock::Create(*TheContext, "then", TheFunction);
@@ -149,7 +641,7 @@ llvm::Value *ASTNode::IfExpressionASTNode::codegen() {
 
     // Write Then block
     Builder->SetInsertPoint(ThenBB);
-    llvm::Value *ThenValue = Then->codegen();
+    llvm::Value *ThenValue = Then->codegenAs(Type.Kind, Type.Lanes);
     if (ThenValue == nullptr) {
         return nullptr;
     }
@@ -161,7 +653,7 @@ llvm::Value *ASTNode::IfExpressionASTNode::codegen() {
     // Write Else block
     TheFunction->insert(TheFunction->end(), ElseBB);
     Builder->SetInsertPoint(ElseBB);
-    llvm::Value *ElseValue = Else->codegen();
+    llvm::Value *ElseValue = Else->codegenAs(Type.Kind, Type.Lanes);
 
     if (ElseValue == nullptr) {
         return nullptr;
@@ -173,7 +665,7 @@ llvm::Value *ASTNode::IfExpressionASTNode::codegen() {
     // Write Merge block
     TheFunction->insert(TheFunction->end(), MergeBB);
     Builder->SetInsertPoint(MergeBB);
-    llvm::PHINode *PN = Builder->CreatePHI(llvm::Type::getDoubleTy(*TheContext), 2, "iftmp");
+    llvm::PHINode *PN = Builder->CreatePHI(getValueType(Type.Kind, Type.Lanes), 2, "iftmp");
 
     PN->addIncoming(ThenValue, ThenBB);
     PN->addIncoming(ElseValue, ElseBB);
@@ -181,22 +673,29 @@ llvm::Value *ASTNode::IfExpressionASTNode::codegen() {
     return PN;
 }
 
+// Rotated loop: the body runs once before the first test, so there is no guard.
+//   preheader: start value -> loop: counter phi, body -> loop.latch: step, end test -> loop or afterloop
+// Every block has the single predecessor/successor loop passes expect, so LoopSimplify has nothing to add
+// and SCEV can read the trip count off the latch compare.
 llvm::Value *ASTNode::ForExpressionASTNode::codegen() {
-    llvm::Value *StartValue = Start->codegen();
+    llvm::Value *StartValue = Start->codegenAs(CounterKind);
     if (StartValue == nullptr) {
         return nullptr;
     }
 
     llvm::Function *TheFunction = Builder->GetInsertBlock()->getParent();
-    llvm::BasicBlock *PreheaderBB = Builder->GetInsertBlock();
+    llvm::BasicBlock *PreheaderBB = llvm::BasicBlock::Create(*TheContext, "loop.preheader", TheFunction);
     llvm::BasicBlock *LoopBB = llvm::BasicBlock::Create(*TheContext, "loop", TheFunction);
+    llvm::BasicBlock *LatchBB = llvm::BasicBlock::Create(*TheContext, "loop.latch");
+    llvm::BasicBlock *AfterBB = llvm::BasicBlock::Create(*TheContext, "afterloop");
+    Builder->CreateBr(PreheaderBB);
+    Builder->SetInsertPoint(PreheaderBB);
     Builder->CreateBr(LoopBB);
 
     Builder->SetInsertPoint(LoopBB);
-    llvm::PHINode *Variable = Builder->CreatePHI(llvm::Type::getDoubleTy(*TheContext), 2, VariableName);
+    llvm::PHINode *Variable = Builder->CreatePHI(getValueType(CounterKind), 2, VariableName);
     Variable->addIncoming(StartValue, PreheaderBB);
 
-
     llvm::Value *OuterVariableValue = NamedValues[VariableName];
     NamedValues[VariableName] = Variable;
 
@@ -204,37 +703,43 @@ llvm::Value *ASTNode::ForExpressionASTNode::codegen() {
     if (BodyValue == nullptr) {
         return nullptr;
     }
+    Builder->CreateBr(LatchBB);
+
+    TheFunction->insert(TheFunction->end(), LatchBB);
+    Builder->SetInsertPoint(LatchBB);
 
     // Step
     llvm::Value *StepVariable = nullptr;
     if (Step != nullptr) {
-        StepVariable = Step->codegen();
+        StepVariable = Step->codegenAs(CounterKind);
         if (StepVariable == nullptr) {
             return nullptr;
         }
+    } else if (CounterKind == ValueKind::Integer) {
+        StepVariable = Builder->getInt64(1); // Default value for Step
     } else {
         StepVariable = llvm::ConstantFP::get(*TheContext, llvm::APFloat(1.0)); // Default value for Step
     }
 
-    llvm::Value *NextLoopVariable = Builder->CreateFAdd(Variable, StepVariable, "nextloopvariable");
-
+    llvm::Value *NextLoopVariable = CounterKind == ValueKind::Integer
+                                        ? Builder->CreateAdd(Variable, StepVariable, "nextloopvariable", false,
+                                                             CounterAssumed == false)
+                                        : Builder->CreateFAdd(Variable, StepVariable, "nextloopvariable");
 
-    // End
-    llvm::Value *EndCondition = End->codegen();
+    // End, tested on the counter value of the iteration that just ran
+    llvm::Value *EndCondition = codegenCondition(*End);
     if (EndCondition == nullptr) {
         return nullptr;
     }
-    EndCondition = Builder->CreateFCmpONE(EndCondition, llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0)),
-                                          "loopcondition");
 
+    // Step and End may contain ifs, so the latch is wherever their code ended
     llvm::BasicBlock *LoopEndBB = Builder->GetInsertBlock();
-    llvm::BasicBlock *AfterBB = llvm::BasicBlock::Create(*TheContext, "afterloop", TheFunction);
-
     Builder->CreateCondBr(EndCondition, LoopBB, AfterBB);
-    Builder->SetInsertPoint(AfterBB);
-
     Variable->addIncoming(NextLoopVariable, LoopEndBB);
 
+    TheFunction->insert(TheFunction->end(), AfterBB);
+    Builder->SetInsertPoint(AfterBB);
+
     if (OuterVariableValue != nullptr) {
         NamedValues[VariableName] = OuterVariableValue;
     } else {
@@ -244,22 +749,140 @@ llvm::Value *ASTNode::ForExpressionASTNode::codegen() {
 }
 
 
+// Runtime externs only touch the runtime's own buffers, so calls to them do not clobber anything LLVM can see
+static void addRuntimeAttributes(llvm::Function *F, const Runtime::RuntimeFunction &RF) {
+    F->setDoesNotThrow();
+    F->setWillReturn();
+    F->setDoesNotFreeMemory();
+    if (RF.Effects == Runtime::Effect::None) {
+        F->setDoesNotAccessMemory();
+    } else {
+        F->setMemoryEffects(llvm::MemoryEffects::inaccessibleMemOnly());
+    }
+}
+
 llvm::Function *ASTNode::SignatureASTNode::codegen() {
-    std::vector<llvm::Type *> Doubles(Arguments.size(), llvm::Type::getDoubleTy(*TheContext));
-    llvm::FunctionType *FT = llvm::FunctionType::get(llvm::Type::getDoubleTy(*TheContext), Doubles, false);
+    std::vector<llvm::Type *> ArgumentTypes;
+    for (unsigned int Lanes: ArgumentLanes) {
+        ArgumentTypes.push_back(getLanesType(Lanes));
+    }
+    llvm::FunctionType *FT = llvm::FunctionType::get(getLanesType(ReturnLanes), ArgumentTypes, false);
     llvm::Function *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, Name, TheModule.get());
 
     unsigned int Index = 0;
     for (auto &Argument: F->args()) {
         Argument.setName(Arguments[Index++]);
     }
+
+    auto *RF = Runtime::findRuntimeFunction(Name);
+    if (RF != nullptr and RF->Arity == Arguments.size()) {
+        addRuntimeAttributes(F, *RF);
+    }
+
+    // Purity inferred when this function was defined, so calls to it can be CSE'd and hoisted, unless
+    // it fills a memo cache or safepoints poll in it
+    if (Pure) {
+        SetPure(*F, HiddenState or (isAOT() == false and TheJit->hasSafepoints()), AlwaysReturns);
+    }
     return F;
 }
 
+static llvm::FastMathFlags getFastMathFlags(ASTNode::FloatingPointMode Mode) {
+    llvm::FastMathFlags FMF;
+    if (Mode == ASTNode::FloatingPointMode::Contract) {
+        FMF.setAllowContract();
+    } else if (Mode == ASTNode::FloatingPointMode::Fast) {
+        FMF.setFast();
+    }
+    return FMF;
+}
+
+// Function level view of the same flags, read by the backend and some IR passes
+static void addFloatingPointAttributes(llvm::Function *F, ASTNode::FloatingPointMode Mode) {
+    if (Mode != ASTNode::FloatingPointMode::Fast) {
+        return;
+    }
+    F->addFnAttr("unsafe-fp-math", "true");
+    F->addFnAttr("no-nans-fp-math", "true");
+    F->addFnAttr("no-infs-fp-math", "true");
+    F->addFnAttr("no-signed-zeros-fp-math", "true");
+    F->addFnAttr("approx-func-fp-math", "true");
+}
+
+// Body of a `memo` function: return the cached result for these arguments, or call Implementation and cache it
+static void emitMemoWrapper(llvm::Function *Wrapper, llvm::Function *Implementation) {
+    llvm::Type *DoubleType = Builder->getDoubleTy();
+    llvm::Type *PointerType = Builder->getPtrTy();
+    llvm::Type *SizeType = Builder->getInt64Ty();
+
+    llvm::Value *Table = new llvm::GlobalVariable(*TheModule, PointerType, false, llvm::GlobalValue::InternalLinkage,
+                                                  llvm::ConstantPointerNull::get(Builder->getPtrTy()),
+                                                  Wrapper->getName() + ".memo");
+    llvm::FunctionCallee Lookup = TheModule->getOrInsertFunction(
+        "kal_memo_lookup",
+        llvm::FunctionType::get(Builder->getInt32Ty(), {PointerType, PointerType, PointerType}, false));
+    llvm::FunctionCallee Insert = TheModule->getOrInsertFunction(
+        "kal_memo_insert",
+        llvm::FunctionType::get(Builder->getVoidTy(), {PointerType, PointerType, SizeType, DoubleType}, false));
+    for (auto Callee: {Lookup, Insert}) {
+        auto *F = llvm::cast<llvm::Function>(Callee.getCallee());
+        F->setDoesNotThrow();
+        F->setWillReturn();
+        F->setMemoryEffects(llvm::MemoryEffects::inaccessibleOrArgMemOnly());
+    }
+
+    llvm::BasicBlock *EntryBB = llvm::BasicBlock::Create(*TheContext, "entry", Wrapper);
+    llvm::BasicBlock *HitBB = llvm::BasicBlock::Create(*TheContext, "hit", Wrapper);
+    llvm::BasicBlock *MissBB = llvm::BasicBlock::Create(*TheContext, "miss", Wrapper);
+
+    Builder->SetInsertPoint(EntryBB);
+    auto *ArgumentsType = llvm::ArrayType::get(DoubleType, Wrapper->arg_size());
+    llvm::Value *Arguments = Builder->CreateAlloca(ArgumentsType, nullptr, "arguments");
+    std::vector<llvm::Value *> ArgumentsVector;
+    for (auto &Argument: Wrapper->args()) {
+        Builder->CreateStore(&Argument,
+                             Builder->CreateConstInBoundsGEP2_32(ArgumentsType, Arguments, 0, Argument.getArgNo()));
+        ArgumentsVector.push_back(&Argument);
+    }
+    llvm::Value *Cached = Builder->CreateAlloca(DoubleType, nullptr, "cached");
+    llvm::Value *Found = Builder->CreateCall(
+        Lookup, {Table, Arguments, Cached}, "found");
+    Builder->CreateCondBr(Builder->CreateICmpNE(Found, Builder->getInt32(0)), HitBB, MissBB);
+
+    Builder->SetInsertPoint(HitBB);
+    Builder->CreateRet(Builder->CreateLoad(DoubleType, Cached, "cachedvalue"));
+
+    Builder->SetInsertPoint(MissBB);
+    llvm::Value *Result = Builder->CreateCall(Implementation, ArgumentsVector, "result");
+    Builder->CreateCall(Insert, {Table, Arguments, Builder->getInt64(Wrapper->arg_size()), Result});
+    Builder->CreateRet(Result);
+}
+
 llvm::Function *ASTNode::FunctionASTNode::codegen() {
     auto &P = *Signature;
     Signatures[Signature->getName()] = std::move(Signature);
 
+    // Types first: the function type of a top-level expression depends on its result
+    TypeEnvironment Environment;
+    for (size_t i = 0; i < P.getArguments().size(); ++i) {
+        unsigned int Lanes = P.getArgumentLanes()[i];
+        Environment[P.getArguments()[i]] = Lanes == 0
+                                               ? VariableType{ValueKind::Double, 0, 0}
+                                               : VariableType{ValueKind::Vector, 0, 0, Lanes};
+    }
+    Body->inferTypes(Environment);
+
+    // The host cannot portably call a function returning a vector, so a vector top-level expression
+    // becomes `double __anon_expr(double *Lanes)` around the body, returning the number of lanes
+    bool StoresResult = Qualifiers.TopLevel and Body->getKind() == ValueKind::Vector;
+    if (StoresResult) {
+        P.setReturnLanes(Body->getType().Lanes);
+    }
+    if (Qualifiers.Memoize and P.hasVectors()) {
+        LogErrorV("memo functions take and return numbers only");
+        return nullptr;
+    }
+
     llvm::Function *TheFunction = TheModule->getFunction(P.getName());
 
     if (TheFunction == nullptr) {
@@ -275,21 +898,79 @@ llvm::Function *ASTNode::FunctionASTNode::codegen() {
         return nullptr;
     }
 
-    llvm::BasicBlock *BB = llvm::BasicBlock::Create(*TheContext, "entry", TheFunction);
+    // A memo function is a caching wrapper around an internal function with the body
+    llvm::Function *BodyFunction = TheFunction;
+    if (Qualifiers.Memoize) {
+        BodyFunction = llvm::Function::Create(TheFunction->getFunctionType(), llvm::Function::InternalLinkage,
+                                              P.getName() + ".impl", TheModule.get());
+        for (auto &Argument: BodyFunction->args()) {
+            Argument.setName(TheFunction->getArg(Argument.getArgNo())->getName());
+        }
+        // Recursive calls go through the cache: assume it is pure until the body is checked
+        SetPure(*TheFunction, true, false);
+    } else if (StoresResult) {
+        BodyFunction->setName(P.getName() + ".vector");
+        BodyFunction->setLinkage(llvm::Function::InternalLinkage);
+        TheFunction = llvm::Function::Create(
+            llvm::FunctionType::get(Builder->getDoubleTy(), {Builder->getPtrTy()}, false),
+            llvm::Function::ExternalLinkage, P.getName(), TheModule.get());
+    }
+
+    llvm::BasicBlock *BB = llvm::BasicBlock::Create(*TheContext, "entry", BodyFunction);
     Builder->SetInsertPoint(BB);
 
+    FloatingPointMode Mode = Qualifiers.FPMode == FloatingPointMode::Default
+                                 ? DefaultFloatingPointMode
+                                 : Qualifiers.FPMode;
+    Builder->setFastMathFlags(getFastMathFlags(Mode));
+    addFloatingPointAttributes(BodyFunction, Mode);
+
     NamedValues.clear();
-    for (auto &Argument: TheFunction->args()) {
+    for (auto &Argument: BodyFunction->args()) {
         NamedValues[Argument.getName().str()] = &Argument;
     }
 
-    llvm::Value *ReturnValue = Body->codegen();
-    if (ReturnValue == nullptr) {
+    bool Generated = Body->codegenTail();
+    Builder->clearFastMathFlags();
+    if (Generated == false) {
+        if (BodyFunction != TheFunction) {
+            BodyFunction->eraseFromParent();
+        }
         TheFunction->eraseFromParent();
         return nullptr;
     }
-    Builder->CreateRet(ReturnValue);
+    llvm::verifyFunction(*BodyFunction);
+    TheFPM->run(*BodyFunction, *TheFAM);
+
+    if (StoresResult) {
+        Builder->SetInsertPoint(llvm::BasicBlock::Create(*TheContext, "entry", TheFunction));
+        Builder->CreateStore(Builder->CreateCall(BodyFunction, {}, "result"), TheFunction->getArg(0));
+        Builder->CreateRet(llvm::ConstantFP::get(Builder->getDoubleTy(), P.getReturnLanes()));
+        llvm::verifyFunction(*TheFunction);
+        return TheFunction;
+    }
+
+    if (Qualifiers.Memoize == false) {
+        P.setPurity(IsPure(*TheFunction), TheFunction->willReturn(), TheFunction->hasFnAttribute(PureAttribute));
+        return TheFunction;
+    }
+
+    if (IsPure(*BodyFunction) == false) {
+        // TheFPM left analyses of the body cached
+        TheFAM->clear(*BodyFunction, BodyFunction->getName());
+        BodyFunction->eraseFromParent();
+        TheFunction->eraseFromParent();
+        LogErrorV("memo function must be pure (no I/O and only calls to pure functions)");
+        return nullptr;
+    }
+    // The wrapper writes its cache, a global of this module. Callers in other modules declare it
+    // inaccessiblememonly (see SetPure), and so does the body, which must not get the stores by inlining.
+    TheFunction->setMemoryEffects(llvm::MemoryEffects::unknown());
+    TheFunction->removeFnAttr(PureAttribute);
+    TheFunction->addFnAttr(llvm::Attribute::NoInline);
+    emitMemoWrapper(TheFunction, BodyFunction);
     llvm::verifyFunction(*TheFunction);
-    TheFPM->run(*TheFunction, *TheFAM);
+    // The cache is invisible to callers: for them the result only depends on the arguments
+    P.setPurity(true, false, true);
     return TheFunction;
 }
@@ -2,6 +2,7 @@
 #define CODEGEN_H
 
 #include <map>
+#include <optional>
 
 #include "ast.h"
 #include "llvm/IR/LLVMContext.h"
@@ -12,14 +13,14 @@
 #include "llvm/ADT/APFloat.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/Analysis/LoopAnalysisManager.h"
 #include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Support/DynamicLibrary.h"
 #include "llvm/Passes/StandardInstrumentations.h"
 #include "llvm/Passes/PassBuilder.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar/Reassociate.h"
-#include "llvm/Transforms/Scalar/GVN.h"
-#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
 #include "jit.h"
 
 extern std::unique_ptr<llvm::LLVMContext> TheContext; // Tool set
@@ -42,8 +43,26 @@ extern llvm::ExitOnError ExitOnErr;
 
 extern std::map<std::string, std::unique_ptr<ASTNode::SignatureASTNode> > Signatures;
 
+extern ASTNode::FloatingPointMode DefaultFloatingPointMode; // For definitions without an fp qualifier
+
+extern llvm::OptimizationLevel DefinitionOptimizationLevel; // -O: definitions, and the whole module in AOT mode
+extern llvm::OptimizationLevel ExpressionOptimizationLevel; // --expr-O: top-level expressions, run once
+
 void InitializeModuleAndManagers();
 
+// Target of the generated code: the JIT's in the REPL, the object file's in AOT mode
+llvm::TargetMachine *getTargetMachine();
+
+// '0', '1', '2', '3', 's' or 'z'
+std::optional<llvm::OptimizationLevel> parseOptimizationLevel(char Level);
+
+// Run the standard module pipeline of Level on TheModule
+void OptimizeModule(llvm::OptimizationLevel Level);
+
+// `int32_t <Expression>.main(int32_t, char **)`, which calls the top-level expression Expression and prints its
+// result (Lanes as in its signature) in the process running it, for JIT::runAsMain
+llvm::Function *codegenExpressionMain(llvm::Function *Expression, unsigned int Lanes);
+
 llvm::Value *LogErrorV(const char *str);
 
 
@@ -0,0 +1,50 @@
+// kaleidoscope-executor: runs the JIT-compiled code of a session started with `main --executor`. The compiler
+// starts it with the descriptors of two pipes and sends it code and calls through them; a crash here ends only
+// this process.
+//
+//   kaleidoscope-executor <input descriptor> <output descriptor> [readd() input file]
+
+#include "library.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "llvm/ExecutionEngine/Orc/TargetProcess/SimpleExecutorDylibManager.h"
+#include "llvm/ExecutionEngine/Orc/TargetProcess/SimpleExecutorMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/TargetProcess/SimpleRemoteEPCServer.h"
+#include "llvm/Support/Error.h"
+
+int main(int argc, char *argv[]) {
+    llvm::ExitOnError ExitOnErr("kaleidoscope-executor: ");
+    if (argc != 3 and argc != 4) {
+        fprintf(stderr, "Usage: %s <input descriptor> <output descriptor> [input file]\n", argv[0]);
+        return 1;
+    }
+
+    // stdin belongs to the compiler's parser
+    if (argc == 4 and Runtime::setInputFile(argv[3]) == false) {
+        fprintf(stderr, "Error: cannot open input file '%s'\n", argv[3]);
+        return 1;
+    }
+    if (argc == 3) {
+        freopen("/dev/null", "r", stdin);
+    }
+
+    auto Server = ExitOnErr(llvm::orc::SimpleRemoteEPCServer::Create<llvm::orc::FDSimpleRemoteEPCTransport>(
+        [](llvm::orc::SimpleRemoteEPCServer::Setup &S) -> llvm::Error {
+            S.setDispatcher(std::make_unique<llvm::orc::SimpleRemoteEPCServer::ThreadDispatcher>());
+            S.bootstrapSymbols() = llvm::orc::SimpleRemoteEPCServer::defaultBootstrapSymbols();
+            // The compiler binds the runtime functions to this process's copy (JIT::defineRuntimeSymbols)
+            for (auto &[Name, Address]: Runtime::getSymbols()) {
+                S.bootstrapSymbols()[Name] = llvm::orc::ExecutorAddr::fromPtr(Address);
+            }
+            S.services().push_back(std::make_unique<llvm::orc::rt_bootstrap::SimpleExecutorMemoryManager>());
+            S.services().push_back(std::make_unique<llvm::orc::rt_bootstrap::SimpleExecutorDylibManager>());
+            return llvm::Error::success();
+        },
+        atoi(argv[1]), atoi(argv[2])));
+
+    ExitOnErr(Server->waitForDisconnect());
+    Runtime::flushOutput();
+    return 0;
+}
@@ -0,0 +1,272 @@
+// :load-ir and IR files on the command line: hand-written or clang-generated kernels called like definitions
+
+#include "irimport.h"
+#include "codegen.h"
+#include "aot.h"
+
+#include <map>
+#include <memory>
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+// Imported functions by name, with the bitcode of their inlinable copies (nullptr when there is none)
+static std::map<std::string, std::shared_ptr<const llvm::MemoryBuffer> > ImportedFunctions;
+
+// Bitcode of every imported module, for a new executor process (with --executor only)
+static std::vector<std::unique_ptr<llvm::MemoryBuffer> > ImportedModules;
+
+// 0 for double, N for <N x double> with N = 2, 4 or 8: the types Kaleidoscope passes
+static bool getLanes(llvm::Type *T, unsigned int &Lanes) {
+    if (T->isDoubleTy()) {
+        Lanes = 0;
+        return true;
+    }
+    auto *VectorType = llvm::dyn_cast<llvm::FixedVectorType>(T);
+    if (VectorType == nullptr or VectorType->getElementType()->isDoubleTy() == false) {
+        return false;
+    }
+    Lanes = VectorType->getNumElements();
+    return Lanes == 2 or Lanes == 4 or Lanes == 8;
+}
+
+// Signature of F if it takes and returns numbers and vecN, else nullptr
+static std::unique_ptr<ASTNode::SignatureASTNode> getSignature(const llvm::Function &F) {
+    unsigned int ReturnLanes;
+    if (F.isVarArg() or getLanes(F.getReturnType(), ReturnLanes) == false) {
+        return nullptr;
+    }
+    std::vector<std::string> Arguments;
+    std::vector<unsigned int> ArgumentLanes;
+    for (const llvm::Argument &Argument: F.args()) {
+        unsigned int Lanes;
+        if (getLanes(Argument.getType(), Lanes) == false) {
+            return nullptr;
+        }
+        // clang drops the names of arguments in release builds
+        Arguments.push_back(Argument.hasName() ? Argument.getName().str() : "x" + std::to_string(Arguments.size()));
+        ArgumentLanes.push_back(Lanes);
+    }
+    return std::make_unique<ASTNode::SignatureASTNode>(F.getName().str(), std::move(Arguments),
+                                                       std::move(ArgumentLanes), ReturnLanes);
+}
+
+// Functions that use V, through constant expressions and global initializers too
+static void collectUsers(llvm::Value &V, llvm::SmallVectorImpl<llvm::Function *> &Functions) {
+    for (llvm::User *U: V.users()) {
+        if (auto *I = llvm::dyn_cast<llvm::Instruction>(U)) {
+            Functions.push_back(I->getFunction());
+        } else if (llvm::isa<llvm::Constant>(U)) {
+            collectUsers(*U, Functions);
+        }
+    }
+}
+
+// Turn a copy of an imported module into bodies that callers in other modules may inline; returns the
+// functions that have one. Mutable globals stay in the JIT's copy of the module, and functions that reach
+// mutable globals with local linkage (which the copy would duplicate) become declarations.
+static std::vector<std::string> makeInlineCopy(llvm::Module &M) {
+    if (M.alias_empty() == false or M.ifunc_empty() == false) {
+        return {};
+    }
+
+    llvm::SmallPtrSet<llvm::Function *, 16> UsesLocalState;
+    llvm::SmallVector<llvm::Function *, 16> Worklist;
+    for (llvm::GlobalVariable &GV: M.globals()) {
+        if (GV.hasLocalLinkage() and GV.isConstant() == false) {
+            collectUsers(GV, Worklist);
+        }
+    }
+    while (Worklist.empty() == false) {
+        llvm::Function *F = Worklist.pop_back_val();
+        if (UsesLocalState.insert(F).second) {
+            collectUsers(*F, Worklist);
+        }
+    }
+
+    std::vector<std::string> Inlinable;
+    for (llvm::Function &F: M) {
+        if (F.isDeclaration() or F.hasLocalLinkage()) {
+            continue;
+        }
+        if (UsesLocalState.count(&F) != 0) {
+            F.deleteBody();
+            continue;
+        }
+        F.setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+        F.setComdat(nullptr);
+        Inlinable.push_back(F.getName().str());
+    }
+    for (llvm::GlobalVariable &GV: M.globals()) {
+        if (GV.isDeclaration() or GV.hasLocalLinkage()) {
+            continue;
+        }
+        if (GV.isConstant()) {
+            GV.setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+        } else {
+            GV.setInitializer(nullptr);
+            GV.setLinkage(llvm::GlobalValue::ExternalLinkage);
+        }
+        GV.setComdat(nullptr);
+    }
+
+    // What is left refers to the JIT's copy, in another module: it may be out of reach of PC-relative
+    // addressing, and hidden symbols would not be found there
+    for (llvm::GlobalValue &GV: M.global_values()) {
+        if (GV.hasLocalLinkage() == false) {
+            GV.setVisibility(llvm::GlobalValue::DefaultVisibility);
+            GV.setDSOLocal(false);
+        }
+    }
+    return Inlinable;
+}
+
+llvm::Expected<std::vector<std::string> > LoadIR(const std::string &Path) {
+    llvm::SMDiagnostic Diagnostic;
+    std::unique_ptr<llvm::Module> Imported = llvm::parseIRFile(Path, Diagnostic, *TheContext);
+    if (Imported == nullptr) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "%s:%d: %s", Path.c_str(),
+                                       Diagnostic.getLineNo(), Diagnostic.getMessage().str().c_str());
+    }
+    llvm::Triple ImportedTriple(Imported->getTargetTriple());
+    if (ImportedTriple.getArch() != llvm::Triple::UnknownArch and
+        ImportedTriple.getArch() != getTargetMachine()->getTargetTriple().getArch()) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "%s: compiled for %s", Path.c_str(),
+                                       ImportedTriple.str().c_str());
+    }
+    Imported->setTargetTriple(TheModule->getTargetTriple());
+    Imported->setDataLayout(TheModule->getDataLayout());
+
+    // Check everything before the session changes: callers are compiled against these signatures
+    std::vector<std::unique_ptr<ASTNode::SignatureASTNode> > NewSignatures;
+    for (const llvm::Function &F: *Imported) {
+        if (F.isDeclaration() or F.hasLocalLinkage()) {
+            continue;
+        }
+        std::string Name = F.getName().str();
+        auto Existing = Signatures.find(Name);
+        if (ImportedFunctions.count(Name) != 0 or (Existing != Signatures.end() and
+                                                   Existing->second->isExtern() == false)) {
+            return llvm::createStringError(llvm::inconvertibleErrorCode(), "%s: %s is already defined",
+                                           Path.c_str(), Name.c_str());
+        }
+        auto Signature = getSignature(F);
+        if (Signature == nullptr) {
+            if (Existing != Signatures.end()) {
+                return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                               "%s: %s does not take and return numbers or vectors of doubles",
+                                               Path.c_str(), Name.c_str());
+            }
+            continue; // a helper of the other functions
+        }
+        if (Existing != Signatures.end() and
+            (Existing->second->getArgumentLanes() != Signature->getArgumentLanes() or
+             Existing->second->getReturnLanes() != Signature->getReturnLanes())) {
+            return llvm::createStringError(llvm::inconvertibleErrorCode(), "%s: %s does not match its extern",
+                                           Path.c_str(), Name.c_str());
+        }
+        NewSignatures.push_back(std::move(Signature));
+    }
+
+    // TheModule only holds extern declarations between statements in the REPL, and every definition
+    // in AOT mode, which is optimized with them at the end
+    if (llvm::Linker::linkModules(*TheModule, std::move(Imported))) {
+        if (isAOT() == false) {
+            InitializeModuleAndManagers();
+        }
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "%s: cannot link", Path.c_str());
+    }
+    std::shared_ptr<const llvm::MemoryBuffer> InlineCopy;
+    std::vector<std::string> Inlinable;
+    std::unique_ptr<llvm::MemoryBuffer> RemoteCopy; // Restored in a new executor (RestoreImportedModules)
+    if (isAOT() == false) {
+        OptimizeModule(DefinitionOptimizationLevel);
+
+        auto Copy = llvm::CloneModule(*TheModule);
+        Inlinable = makeInlineCopy(*Copy);
+        llvm::SmallVector<char, 0> Buffer;
+        llvm::raw_svector_ostream OS(Buffer);
+        llvm::WriteBitcodeToFile(*Copy, OS);
+        InlineCopy = llvm::MemoryBuffer::getMemBufferCopy(llvm::StringRef(Buffer.data(), Buffer.size()), Path);
+
+        // Hidden symbols would not be visible to the modules of the callers
+        for (llvm::GlobalValue &GV: TheModule->global_values()) {
+            if (GV.hasLocalLinkage() == false) {
+                GV.setVisibility(llvm::GlobalValue::DefaultVisibility);
+            }
+        }
+
+        if (TheJit->isRemote()) {
+            Buffer.clear();
+            llvm::WriteBitcodeToFile(*TheModule, OS);
+            RemoteCopy = llvm::MemoryBuffer::getMemBufferCopy(llvm::StringRef(Buffer.data(), Buffer.size()), Path);
+        }
+    }
+
+    for (auto &Signature: NewSignatures) {
+        const llvm::Function *F = TheModule->getFunction(Signature->getName());
+        Signature->setPurity(F->doesNotAccessMemory(), F->willReturn());
+        Signature->setExtern(); // :save records it as an extern
+    }
+
+    if (isAOT() == false) {
+        auto Error = TheJit->addForeignModule(
+            llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext)));
+        InitializeModuleAndManagers();
+        if (Error) {
+            return std::move(Error);
+        }
+    }
+
+    // Only now that the JIT has the module: callers compiled against these would not link otherwise
+    if (RemoteCopy != nullptr) {
+        ImportedModules.push_back(std::move(RemoteCopy));
+    }
+    std::vector<std::string> Names;
+    for (auto &Signature: NewSignatures) {
+        const std::string &Name = Signature->getName();
+        ImportedFunctions[Name] = llvm::is_contained(Inlinable, Name) ? InlineCopy : nullptr;
+        Signatures[Name] = std::move(Signature);
+        Names.push_back(Name);
+    }
+    return Names;
+}
+
+bool isImportedFunction(llvm::StringRef Name) {
+    return ImportedFunctions.count(Name.str()) != 0;
+}
+
+bool LinkImportedBody(const std::string &Name) {
+    auto Imported = ImportedFunctions.find(Name);
+    if (Imported == ImportedFunctions.end() or Imported->second == nullptr) {
+        return false;
+    }
+    // Only what TheModule declares is read from the bitcode and linked
+    auto Copy = llvm::getLazyBitcodeModule(Imported->second->getMemBufferRef(), *TheContext);
+    if (!Copy) {
+        llvm::consumeError(Copy.takeError());
+        return false;
+    }
+    return llvm::Linker::linkModules(*TheModule, std::move(*Copy), llvm::Linker::Flags::LinkOnlyNeeded) == false;
+}
+
+llvm::Error RestoreImportedModules() {
+    for (auto &Bitcode: ImportedModules) {
+        auto Context = std::make_unique<llvm::LLVMContext>();
+        auto M = llvm::parseBitcodeFile(Bitcode->getMemBufferRef(), *Context);
+        if (!M) {
+            return M.takeError();
+        }
+        auto Error = TheJit->addForeignModule(llvm::orc::ThreadSafeModule(std::move(*M), std::move(Context)));
+        if (Error) {
+            return Error;
+        }
+    }
+    return llvm::Error::success();
+}
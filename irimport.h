@@ -0,0 +1,24 @@
+#ifndef IRIMPORT_H
+#define IRIMPORT_H
+
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+
+// Link the LLVM IR (.ll) or bitcode (.bc) file Path into the session. Its external functions that take
+// and return numbers and vecN become callable like definitions; returns their names.
+llvm::Expected<std::vector<std::string> > LoadIR(const std::string &Path);
+
+// Whether Name is a function of a loaded IR file
+bool isImportedFunction(llvm::StringRef Name);
+
+// Replace the declaration of the imported function Name in TheModule by an available_externally
+// copy of its body, so calls to it can be inlined. false if Name has no body to copy.
+bool LinkImportedBody(const std::string &Name);
+
+// Add every loaded IR module to a new JIT (see JIT::recreate)
+llvm::Error RestoreImportedModules();
+
+#endif
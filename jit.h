@@ -1,102 +1,909 @@
 #ifndef JIT_H
 #define JIT_H
 
+#include "llvm/Config/llvm-config.h"
+#if LLVM_VERSION_MAJOR >= 18
+#include "llvm/ExecutionEngine/Orc/AbsoluteSymbols.h"
+#endif
 #include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/EPCDynamicLibrarySearchGenerator.h"
+#include "llvm/ExecutionEngine/Orc/EPCIndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/Mangling.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/SelfExecutorProcessControl.h"
+#include "llvm/ExecutionEngine/Orc/SimpleRemoteEPC.h"
+#include "llvm/ExecutionEngine/Orc/Shared/SimpleRemoteEPCUtils.h"
+#include "llvm/ExecutionEngine/Orc/TaskDispatch.h"
+#include "llvm/ADT/FunctionExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/TargetParser/SubtargetFeature.h"
+
+#include <csignal>
+#include <cstdio>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "safepoint.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Defines symbols up front but only produces (and compiles) their module when one of them is looked up
+class LazyModuleMaterializationUnit : public llvm::orc::MaterializationUnit {
+public:
+    using ModuleLoader = llvm::unique_function<llvm::Expected<llvm::orc::ThreadSafeModule>()>;
+
+private:
+    llvm::orc::IRLayer &Layer;
+    ModuleLoader Load;
+
+public:
+    LazyModuleMaterializationUnit(llvm::orc::IRLayer &Layer, Interface I, ModuleLoader Load)
+        : MaterializationUnit(std::move(I)), Layer(Layer), Load(std::move(Load)) {
+    }
+
+    llvm::StringRef getName() const override {
+        return "LazyModuleMaterializationUnit";
+    }
+
+    void materialize(std::unique_ptr<llvm::orc::MaterializationResponsibility> R) override {
+        auto TSM = Load();
+        if (!TSM) {
+            Layer.getExecutionSession().reportError(TSM.takeError());
+            R->failMaterialization();
+            return;
+        }
+        Layer.emit(std::move(R), std::move(*TSM));
+    }
+
+private:
+    void discard(const llvm::orc::JITDylib &JD, const llvm::orc::SymbolStringPtr &Name) override {
+    }
+};
+
+// A LazyCallThroughManager whose trampolines can be given back, so redefining a function reuses the trampoline
+// of its previous version instead of allocating one more
+class ReusableCallThroughManager : public llvm::orc::LazyCallThroughManager {
+    std::unique_ptr<llvm::orc::TrampolinePool> Pool;
+
+    ReusableCallThroughManager(llvm::orc::ExecutionSession &ES, llvm::orc::ExecutorAddr ErrorHandler)
+        : LazyCallThroughManager(ES, ErrorHandler, nullptr) {
+    }
+
+    template <typename ORCABI>
+    llvm::Error init() {
+        auto TP = llvm::orc::LocalTrampolinePool<ORCABI>::Create(
+            [this](llvm::orc::ExecutorAddr Trampoline,
+                   llvm::orc::TrampolinePool::NotifyLandingResolvedFunction NotifyLandingResolved) {
+                resolveTrampolineLandingAddress(Trampoline, std::move(NotifyLandingResolved));
+            });
+        if (!TP) {
+            return TP.takeError();
+        }
+        Pool = std::move(*TP);
+        setTrampolinePool(*Pool);
+        return llvm::Error::success();
+    }
+
+    template <typename ORCABI>
+    static llvm::Expected<std::unique_ptr<ReusableCallThroughManager> >
+    create(llvm::orc::ExecutionSession &ES, llvm::orc::ExecutorAddr ErrorHandler) {
+        std::unique_ptr<ReusableCallThroughManager> Manager(new ReusableCallThroughManager(ES, ErrorHandler));
+        if (auto Error = Manager->init<ORCABI>()) {
+            return std::move(Error);
+        }
+        return std::move(Manager);
+    }
+
+public:
+    // The targets of llvm::orc::createLocalLazyCallThroughManager
+    static llvm::Expected<std::unique_ptr<ReusableCallThroughManager> >
+    Create(const llvm::Triple &T, llvm::orc::ExecutionSession &ES, llvm::orc::ExecutorAddr ErrorHandler) {
+        switch (T.getArch()) {
+            case llvm::Triple::aarch64:
+            case llvm::Triple::aarch64_32:
+                return create<llvm::orc::OrcAArch64>(ES, ErrorHandler);
+            case llvm::Triple::x86:
+                return create<llvm::orc::OrcI386>(ES, ErrorHandler);
+            case llvm::Triple::loongarch64:
+                return create<llvm::orc::OrcLoongArch64>(ES, ErrorHandler);
+            case llvm::Triple::mips:
+                return create<llvm::orc::OrcMips32Be>(ES, ErrorHandler);
+            case llvm::Triple::mipsel:
+                return create<llvm::orc::OrcMips32Le>(ES, ErrorHandler);
+            case llvm::Triple::mips64:
+            case llvm::Triple::mips64el:
+                return create<llvm::orc::OrcMips64>(ES, ErrorHandler);
+            case llvm::Triple::riscv64:
+                return create<llvm::orc::OrcRiscv64>(ES, ErrorHandler);
+            case llvm::Triple::x86_64:
+                if (T.getOS() == llvm::Triple::Win32) {
+                    return create<llvm::orc::OrcX86_64_Win32>(ES, ErrorHandler);
+                }
+                return create<llvm::orc::OrcX86_64_SysV>(ES, ErrorHandler);
+            default:
+                return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                               "no lazy call-through support for %s", T.str().c_str());
+        }
+    }
+
+    // Trampoline, from getCallThroughTrampoline, must not be reached by a call any more. The next
+    // getCallThroughTrampoline may return it for another symbol.
+    void releaseTrampoline(llvm::orc::ExecutorAddr Trampoline) {
+        Pool->releaseTrampoline(Trampoline);
+    }
+};
 
 class JIT {
     std::unique_ptr<llvm::orc::ExecutionSession> ES; // JIT system
     llvm::DataLayout DL; // Information on target device
+    std::unique_ptr<llvm::TargetMachine> TM; // Cost model for the optimization pipelines
     llvm::orc::MangleAndInterner Mangle; // unique name ensurer
 
+    // compiled code resolver: RuntimeDyld in this process, JITLink (which allocates through the executor)
+    // for an executor process
+    std::unique_ptr<llvm::orc::ObjectLayer> ObjectLayer;
     llvm::orc::IRCompileLayer CompileLayer; // LLVM IR -> Machine code generator
-    llvm::orc::RTDyldObjectLinkingLayer ObjectLayer; // compiled code resolver
+    llvm::orc::IRTransformLayer TransformLayer; // Safepoints (see enableSafepoints), then CompileLayer; for
+                                                // generated code only (see addForeignModule)
 
     llvm::orc::JITDylib &MainJD; // Lazy linker
+    llvm::orc::JITDylib &RuntimeJD; // Runtime functions at fixed addresses, then the rest of the process
+
+    bool Concurrent; // Materialization runs on a thread pool
+
+    // Every definition `f` is a stub jumping through a pointer to its current version `f.N`. The pointer
+    // first targets a trampoline that compiles the version on its first call, then the compiled code.
+    // An executor process has no such trampolines: see bindStub.
+    std::unique_ptr<llvm::orc::EPCIndirectionUtils> RemoteIndirection; // Stubs in the executor process
+    std::unique_ptr<ReusableCallThroughManager> CallThrough;
+    std::unique_ptr<llvm::orc::IndirectStubsManager> Stubs;
+    std::map<std::string, llvm::orc::ExecutorAddr> Trampolines; // Name -> trampoline of its latest binding
+    std::map<std::string, std::string> UnboundStubs; // Name -> version the stub must target before code runs
+    struct DefinitionVersion {
+        std::string Implementation; // f.N
+        llvm::orc::ResourceTrackerSP Tracker; // Frees f.N when f is redefined
+        llvm::orc::ResourceTrackerSP EntryTracker; // Code the stub calls instead of f.N (see setEntry), if any
+    };
+    std::map<std::string, DefinitionVersion> Versions; // Current version of each definition
+    unsigned int NextVersion = 0;
+
+    // Addresses found by lookup(), dropped when a module defining the name is added or removed (main thread only)
+    llvm::StringMap<llvm::orc::ExecutorSymbolDef> AddressCache;
+    std::map<llvm::orc::ResourceTracker *, std::vector<std::string> > TrackedSymbols; // Names defined under a tracker
+
+    bool RetainingCode = false; // See retainRemovedCode
+    std::vector<llvm::orc::ResourceTrackerSP> RetainedCode;
+
+    // Process running the code (-1 for this one), and the arguments of Create to start a new one
+    int ExecutorProcess;
+    bool ExecutorVectorMath = false; // libmvec is loaded in the executor process
+    bool Safepoints = false; // See enableSafepoints
+    struct Options {
+        std::string CPU;
+        std::vector<std::string> Features;
+        unsigned int CompileThreads;
+        std::vector<std::string> Executor;
+    } CreateOptions;
+
+public:
+    struct MemoryUsage {
+        uint64_t Code = 0, Data = 0; // Bytes of the loaded sections
+        bool Compiled = false;
+    };
+
+private:
+    // Filled as objects are loaded, possibly on the compile threads
+    std::mutex LoadedObjectsMutex;
+    std::map<uint64_t, std::pair<uint64_t, std::string> > FunctionRanges; // start -> end, name; for :profile
+    std::map<std::string, MemoryUsage> ObjectMemory; // By the (mangled) symbol the module was materialized for
+
+    // "f" for the version "f.3" of a definition, other names unchanged
+    static std::string definitionName(llvm::StringRef Symbol) {
+        auto [Name, Version] = Symbol.rsplit('.');
+        if (Version.empty() == false and Version.find_first_not_of("0123456789") == llvm::StringRef::npos) {
+            return Name.str();
+        }
+        return Symbol.str();
+    }
+
+    void recordLoadedObject(llvm::orc::MaterializationResponsibility &R, const llvm::object::ObjectFile &Object,
+                            const llvm::RuntimeDyld::LoadedObjectInfo &Info) {
+        std::lock_guard<std::mutex> Lock(LoadedObjectsMutex);
+
+        MemoryUsage Usage;
+        Usage.Compiled = true;
+        for (const llvm::object::SectionRef &Section: Object.sections()) {
+            if (Info.getSectionLoadAddress(Section) != 0) {
+                (Section.isText() ? Usage.Code : Usage.Data) += Section.getSize();
+            }
+        }
+        for (auto &Symbol: R.getSymbols()) {
+            ObjectMemory[(*Symbol.first).str()] = Usage;
+        }
+
+        // The debug object has the sections at their load addresses
+        llvm::object::OwningBinary<llvm::object::ObjectFile> DebugObject = Info.getObjectForDebug(Object);
+        if (DebugObject.getBinary() == nullptr) {
+            return;
+        }
+        for (auto &[Symbol, Size]: llvm::object::computeSymbolSizes(*DebugObject.getBinary())) {
+            auto Type = Symbol.getType();
+            auto Name = Symbol.getName();
+            auto Address = Symbol.getAddress();
+            if (!Type or !Name or !Address or *Type != llvm::object::SymbolRef::ST_Function or Size == 0) {
+                llvm::consumeError(Type.takeError());
+                llvm::consumeError(Name.takeError());
+                llvm::consumeError(Address.takeError());
+                continue;
+            }
+            // Memory of removed modules (top-level expressions) is reused: drop the ranges it overlaps
+            uint64_t Start = *Address, End = *Address + Size;
+            auto Overlap = FunctionRanges.lower_bound(Start);
+            if (Overlap != FunctionRanges.begin() and std::prev(Overlap)->second.first > Start) {
+                --Overlap;
+            }
+            while (Overlap != FunctionRanges.end() and Overlap->first < End) {
+                Overlap = FunctionRanges.erase(Overlap);
+            }
+            FunctionRanges[Start] = {End, definitionName(*Name)};
+        }
+    }
+
+    static std::unique_ptr<llvm::orc::ObjectLayer> createObjectLayer(llvm::orc::ExecutionSession &ES, bool Remote) {
+        if (Remote) {
+            return std::make_unique<llvm::orc::ObjectLinkingLayer>(ES);
+        }
+        return std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(ES, [](const llvm::MemoryBuffer &) {
+            return std::make_unique<llvm::SectionMemoryManager>();
+        });
+    }
 
 public:
     // Constructor
     JIT(std::unique_ptr<llvm::orc::ExecutionSession> ES,
         llvm::orc::JITTargetMachineBuilder JTMB,
-        llvm::DataLayout DL)
+        llvm::DataLayout DL,
+        std::unique_ptr<llvm::TargetMachine> TM,
+        std::unique_ptr<ReusableCallThroughManager> CallThrough,
+        std::unique_ptr<llvm::orc::IndirectStubsManager> Stubs,
+        bool Concurrent = false,
+        std::unique_ptr<llvm::orc::EPCIndirectionUtils> RemoteIndirection = nullptr,
+        int ExecutorProcess = -1)
         : ES(std::move(ES)),
           DL(std::move(DL)),
+          TM(std::move(TM)),
           Mangle(*this->ES, this->DL),
+          ObjectLayer(createObjectLayer(*this->ES, ExecutorProcess >= 0)),
           CompileLayer(
-              *this->ES, ObjectLayer,
+              *this->ES, *ObjectLayer,
               std::make_unique<
                   llvm::orc::ConcurrentIRCompiler>(
                   std::move(JTMB))),
-          ObjectLayer(*this->ES,
-                      [](const llvm::MemoryBuffer &) {
-                          return std::make_unique<llvm::SectionMemoryManager>();
-                      }
-          ),
-          MainJD(this->ES->createBareJITDylib("<main>")) {
-        MainJD.addGenerator(
-            llvm::cantFail(llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(DL.getGlobalPrefix())));
-        if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
-            ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
-            ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
+          TransformLayer(*this->ES, CompileLayer),
+          MainJD(this->ES->createBareJITDylib("<main>")),
+          RuntimeJD(this->ES->createBareJITDylib("<runtime>")),
+          Concurrent(Concurrent),
+          RemoteIndirection(std::move(RemoteIndirection)),
+          CallThrough(std::move(CallThrough)),
+          Stubs(std::move(Stubs)),
+          ExecutorProcess(ExecutorProcess) {
+        MainJD.addToLinkOrder(RuntimeJD);
+        if (isRemote()) {
+            // libm and libc of the executor process
+            RuntimeJD.addGenerator(
+                llvm::cantFail(llvm::orc::EPCDynamicLibrarySearchGenerator::GetForTargetProcess(*this->ES)));
+            // The vector variants of its math functions, where there is one (x86-64 glibc)
+            auto VectorMath = llvm::orc::EPCDynamicLibrarySearchGenerator::Load(*this->ES, "libmvec.so.1");
+            if (VectorMath) {
+                RuntimeJD.addGenerator(std::move(*VectorMath));
+                ExecutorVectorMath = true;
+            } else {
+                llvm::consumeError(VectorMath.takeError());
+            }
+            return;
+        }
+
+        // libm, libmvec and libc are still found with dlsym
+        RuntimeJD.addGenerator(
+            llvm::cantFail(llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(this->DL.getGlobalPrefix())));
+        auto &LocalLayer = static_cast<llvm::orc::RTDyldObjectLinkingLayer &>(*ObjectLayer);
+        LocalLayer.setNotifyLoaded([this](llvm::orc::MaterializationResponsibility &R,
+                                          const llvm::object::ObjectFile &Object,
+                                          const llvm::RuntimeDyld::LoadedObjectInfo &Info) {
+            recordLoadedObject(R, Object, Info);
+        });
+        if (this->TM->getTargetTriple().isOSBinFormatCOFF()) {
+            LocalLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
+            LocalLayer.setAutoClaimResponsibilityForObjectSymbols(true);
         }
     }
 
     // Destructor
     ~JIT() {
+        Stubs.reset();
+        if (RemoteIndirection != nullptr) {
+            // Fails if the executor died, and then there is nothing left to free
+            llvm::consumeError(RemoteIndirection->cleanup());
+        }
         if (auto error = ES->endSession()) {
             ES->reportError(std::move(error));
         }
+#ifndef _WIN32
+        // Disconnecting ends the executor
+        if (ExecutorProcess >= 0) {
+            waitpid(ExecutorProcess, nullptr, 0);
+        }
+#endif
     }
 
     // Factory method
-    static llvm::Expected<std::unique_ptr<JIT> > Create() {
-        auto EPC = llvm::orc::SelfExecutorProcessControl::Create();
-        if (!EPC) {
-            return EPC.takeError();
+    // Code is generated for the host CPU and its features, unless CPU names another one ("native" is the host).
+    // Features ("+avx2", "-avx512f", ...) are applied on top.
+    // With CompileThreads, modules are compiled on a pool of that many threads instead of by the caller.
+    // With Executor (a program and its arguments), the code runs in a process started from it, see launchExecutor.
+    static llvm::Expected<std::unique_ptr<JIT> > Create(const std::string &CPU = "",
+                                                        const std::vector<std::string> &Features = {},
+                                                        unsigned int CompileThreads = 0,
+                                                        const std::vector<std::string> &Executor = {}) {
+        bool Remote = Executor.empty() == false;
+        std::unique_ptr<llvm::orc::TaskDispatcher> Dispatcher;
+        // SimpleRemoteEPC also handles the messages of the executor on the pool
+        if (CompileThreads > 0 or Remote) {
+#if LLVM_VERSION_MAJOR >= 20
+            Dispatcher = std::make_unique<llvm::orc::DynamicThreadPoolTaskDispatcher>(
+                CompileThreads > 0 ? std::optional<size_t>(CompileThreads) : std::nullopt);
+#else
+            Dispatcher = std::make_unique<llvm::orc::DynamicThreadPoolTaskDispatcher>();
+#endif
+        }
+        std::unique_ptr<llvm::orc::ExecutorProcessControl> EPC;
+        int ExecutorProcess = -1;
+        if (Remote) {
+            auto Launched = launchExecutor(Executor, std::move(Dispatcher), ExecutorProcess);
+            if (!Launched) {
+                return Launched.takeError();
+            }
+            EPC = std::move(*Launched);
+        } else {
+            auto Self = llvm::orc::SelfExecutorProcessControl::Create(nullptr, std::move(Dispatcher));
+            if (!Self) {
+                return Self.takeError();
+            }
+            EPC = std::move(*Self);
         }
 
-        auto ES = std::make_unique<llvm::orc::ExecutionSession>(std::move(*EPC));
-        llvm::orc::JITTargetMachineBuilder JTMB(ES->getExecutorProcessControl().getTargetTriple());
+        auto ES = std::make_unique<llvm::orc::ExecutionSession>(std::move(EPC));
+        auto Host = llvm::orc::JITTargetMachineBuilder::detectHost();
+        if (!Host) {
+            return Host.takeError();
+        }
+        llvm::orc::JITTargetMachineBuilder JTMB = std::move(*Host);
+        if (CPU.empty() == false and CPU != "native") {
+            JTMB.setCPU(CPU);
+            JTMB.getFeatures() = llvm::SubtargetFeatures();
+        }
+        JTMB.addFeatures(Features);
         auto DL = JTMB.getDefaultDataLayoutForTarget();
 
         if (!DL) {
             return DL.takeError();
         }
 
-        return std::make_unique<JIT>(
+        auto TM = JTMB.createTargetMachine();
+        if (!TM) {
+            return TM.takeError();
+        }
+
+        std::unique_ptr<ReusableCallThroughManager> CallThrough;
+        std::unique_ptr<llvm::orc::IndirectStubsManager> Stubs;
+        std::unique_ptr<llvm::orc::EPCIndirectionUtils> RemoteIndirection;
+        if (Remote) {
+            auto EPCIU = llvm::orc::EPCIndirectionUtils::Create(ES->getExecutorProcessControl());
+            if (!EPCIU) {
+                return EPCIU.takeError();
+            }
+            RemoteIndirection = std::move(*EPCIU);
+            Stubs = RemoteIndirection->createIndirectStubsManager();
+        } else {
+            auto LocalCallThrough = ReusableCallThroughManager::Create(
+                JTMB.getTargetTriple(), *ES, llvm::orc::ExecutorAddr::fromPtr(&compileFailed));
+            if (!LocalCallThrough) {
+                return LocalCallThrough.takeError();
+            }
+            CallThrough = std::move(*LocalCallThrough);
+            Stubs = llvm::orc::createLocalIndirectStubsManagerBuilder(JTMB.getTargetTriple())();
+        }
+
+        auto Jit = std::make_unique<JIT>(
             std::move(ES),
             std::move(JTMB),
-            std::move(*DL)
+            std::move(*DL),
+            std::move(*TM),
+            std::move(CallThrough),
+            std::move(Stubs),
+            CompileThreads > 0 or Remote,
+            std::move(RemoteIndirection),
+            ExecutorProcess
         );
+        Jit->CreateOptions = {CPU, Features, CompileThreads, Executor};
+        return Jit;
+    }
+
+    // A new JIT with the same options, with a new executor process if this one has one
+    llvm::Expected<std::unique_ptr<JIT> > recreate() const {
+        return Create(CreateOptions.CPU, CreateOptions.Features, CreateOptions.CompileThreads,
+                      CreateOptions.Executor);
+    }
+
+private:
+    // Start the program Executor[0] with the descriptors it reads and writes ORC's messages through, then
+    // Executor[1...], as arguments, and connect to it over these pipes
+    static llvm::Expected<std::unique_ptr<llvm::orc::ExecutorProcessControl> >
+    launchExecutor(const std::vector<std::string> &Executor, std::unique_ptr<llvm::orc::TaskDispatcher> Dispatcher,
+                   int &Process) {
+#ifdef _WIN32
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "executor processes need POSIX pipes");
+#else
+        int ToExecutor[2], FromExecutor[2];
+        if (pipe(ToExecutor) != 0) {
+            return llvm::errorCodeToError(std::error_code(errno, std::generic_category()));
+        }
+        if (pipe(FromExecutor) != 0) {
+            auto Error = llvm::errorCodeToError(std::error_code(errno, std::generic_category()));
+            close(ToExecutor[0]);
+            close(ToExecutor[1]);
+            return std::move(Error);
+        }
+        // Only the executor's ends are inherited, so no other executor keeps these pipes open
+        fcntl(ToExecutor[1], F_SETFD, FD_CLOEXEC);
+        fcntl(FromExecutor[0], F_SETFD, FD_CLOEXEC);
+        std::vector<std::string> Arguments = {Executor[0], std::to_string(ToExecutor[0]),
+                                              std::to_string(FromExecutor[1])};
+        Arguments.insert(Arguments.end(), Executor.begin() + 1, Executor.end());
+        std::vector<char *> Argv;
+        for (std::string &Argument: Arguments) {
+            Argv.push_back(Argument.data());
+        }
+        Argv.push_back(nullptr);
+
+        Process = fork();
+        if (Process == 0) {
+            execv(Argv[0], Argv.data());
+            fprintf(stderr, "Error: cannot run %s\n", Argv[0]);
+            _exit(127);
+        }
+        close(ToExecutor[0]);
+        close(FromExecutor[1]);
+        if (Process < 0) {
+            auto Error = llvm::errorCodeToError(std::error_code(errno, std::generic_category()));
+            close(ToExecutor[1]);
+            close(FromExecutor[0]);
+            return std::move(Error);
+        }
+        // Writing to a dead executor must fail instead of ending this process
+        signal(SIGPIPE, SIG_IGN);
+
+        auto EPC = llvm::orc::SimpleRemoteEPC::Create<llvm::orc::FDSimpleRemoteEPCTransport>(
+            std::move(Dispatcher), llvm::orc::SimpleRemoteEPC::Setup(), FromExecutor[0], ToExecutor[1]);
+        if (!EPC) {
+            kill(Process, SIGKILL);
+            waitpid(Process, nullptr, 0);
+            return EPC.takeError();
+        }
+        return std::move(*EPC);
+#endif
     }
 
+    // Called instead of a definition whose version failed to compile on its first call
+    static double compileFailed() {
+        fprintf(stderr, "Error: function failed to compile\n");
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+
+    // Point the stub of Name at a trampoline that compiles Implementation, creating the stub the first time.
+    // The trampoline of the previous binding is given back: nothing runs, and the stub no longer reaches it.
+    // In an executor process, the stub targets kal_compile_failed (of the runtime) until bindUnboundStubs
+    // compiles Implementation and points it there, before JIT code runs again.
+    llvm::Error bindStub(const std::string &Name, const std::string &Implementation) {
+        llvm::orc::ExecutorAddr Target;
+        if (isRemote()) {
+            UnboundStubs[Name] = Implementation;
+            if (Versions.count(Name) != 0) {
+                return llvm::Error::success();
+            }
+            auto CompileFailed = ES->lookup({&RuntimeJD}, Mangle("kal_compile_failed"));
+            if (!CompileFailed) {
+                return CompileFailed.takeError();
+            }
+            Target = CompileFailed->getAddress();
+        } else {
+            auto Trampoline = CallThrough->getCallThroughTrampoline(
+                MainJD, Mangle(Implementation), [this, Name](llvm::orc::ExecutorAddr Address) {
+                    return Stubs->updatePointer(Name, Address);
+                });
+            if (!Trampoline) {
+                return Trampoline.takeError();
+            }
+            auto Previous = Trampolines.find(Name);
+            if (Previous != Trampolines.end()) {
+                CallThrough->releaseTrampoline(Previous->second);
+            }
+            Trampolines[Name] = *Trampoline;
+            if (Versions.count(Name) != 0) {
+                return Stubs->updatePointer(Name, *Trampoline);
+            }
+            Target = *Trampoline;
+        }
+        auto Flags = llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable;
+        if (auto Error = Stubs->createStub(Name, Target, Flags)) {
+            return Error;
+        }
+        llvm::orc::SymbolMap Symbols;
+        Symbols[Mangle(Name)] = Stubs->findStub(Name, true);
+        return MainJD.define(llvm::orc::absoluteSymbols(std::move(Symbols)));
+    }
+
+    // Make Implementation, just added under Tracker, the current version of Name and free the previous one.
+    // Every call reaches a version through the stub and nothing runs while the REPL handles a statement,
+    // so no caller is left in the old code.
+    llvm::Error replaceVersion(const std::string &Name, const std::string &Implementation,
+                               llvm::orc::ResourceTrackerSP Tracker) {
+        if (auto Error = bindStub(Name, Implementation)) {
+            return Error;
+        }
+        auto Previous = Versions.find(Name);
+        if (Previous != Versions.end()) {
+            DefinitionVersion PreviousVersion = std::move(Previous->second);
+            Previous->second = {Implementation, Tracker, nullptr};
+            if (PreviousVersion.EntryTracker != nullptr) {
+                if (auto Error = removeModule(PreviousVersion.EntryTracker)) {
+                    return Error;
+                }
+            }
+            return removeModule(PreviousVersion.Tracker);
+        }
+        Versions[Name] = {Implementation, Tracker, nullptr};
+        return llvm::Error::success();
+    }
+
+    // Make Tracker (nullptr for none) the entry of Version and free the previous one
+    llvm::Error replaceEntry(DefinitionVersion &Version, llvm::orc::ResourceTrackerSP Tracker) {
+        llvm::orc::ResourceTrackerSP Previous = std::move(Version.EntryTracker);
+        Version.EntryTracker = std::move(Tracker);
+        return Previous != nullptr ? removeModule(Previous) : llvm::Error::success();
+    }
+
+public:
+
     // Getter
     const llvm::DataLayout &getDataLayout() const {
         return DL;
     }
 
+    llvm::TargetMachine *getTargetMachine() const {
+        return TM.get();
+    }
+
     llvm::orc::JITDylib &getMainJITDylib() {
         return MainJD;
     }
 
+    bool compilesConcurrently() const {
+        return Concurrent;
+    }
+
+    // JIT code runs in an executor process
+    bool isRemote() const {
+        return ExecutorProcess >= 0;
+    }
+
+    // Generated code polls safepoints
+    bool hasSafepoints() const {
+        return Safepoints;
+    }
+
+    // Code for an executor process may call libmvec
+    bool hasExecutorVectorMath() const {
+        return ExecutorVectorMath;
+    }
+
+
+    // Name of the compiled function containing Address, empty if there is none
+    std::string findFunction(uint64_t Address) {
+        std::lock_guard<std::mutex> Lock(LoadedObjectsMutex);
+        auto Range = FunctionRanges.upper_bound(Address);
+        if (Range == FunctionRanges.begin() or Address >= std::prev(Range)->second.first) {
+            return "";
+        }
+        return std::prev(Range)->second.second;
+    }
+
+    // Bind the runtime functions (name, address) without a dlsym per symbol, nor an exported symbol table.
+    // An executor process sends the addresses of its own copy of the runtime when it starts: these are used.
+    llvm::Error defineRuntimeSymbols(llvm::ArrayRef<std::pair<const char *, const void *> > Runtime) {
+        llvm::orc::SymbolMap Symbols;
+        for (auto &[Name, Address]: Runtime) {
+            llvm::orc::ExecutorAddr Target = llvm::orc::ExecutorAddr::fromPtr(Address);
+            if (isRemote()) {
+                auto &Executor = ES->getExecutorProcessControl().getBootstrapSymbolsMap();
+                auto Found = Executor.find(Name);
+                if (Found == Executor.end()) {
+                    return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                                   "the executor does not provide %s", Name);
+                }
+                Target = Found->second;
+            }
+            Symbols[Mangle(Name)] = llvm::orc::ExecutorSymbolDef(
+                Target, llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable);
+        }
+        return RuntimeJD.define(llvm::orc::absoluteSymbols(std::move(Symbols)));
+    }
 
     // Register LLVM IR to JIT
     llvm::Error addModule(llvm::orc::ThreadSafeModule TSM, llvm::orc::ResourceTrackerSP RT = nullptr) {
+        return addModuleTo(TransformLayer, std::move(TSM), std::move(RT));
+    }
+
+    // Register LLVM IR that Kaleidoscope did not generate (LoadIR): it is compiled as it is, without safepoints.
+    // Callers were optimized with its memory effects, and abandoning it halfway could leave its own state
+    // (static variables, ...) inconsistent.
+    llvm::Error addForeignModule(llvm::orc::ThreadSafeModule TSM) {
+        return addModuleTo(CompileLayer, std::move(TSM), nullptr);
+    }
+
+private:
+    llvm::Error addModuleTo(llvm::orc::IRLayer &Layer, llvm::orc::ThreadSafeModule TSM,
+                            llvm::orc::ResourceTrackerSP RT) {
         if (RT == nullptr) {
             RT = MainJD.getDefaultResourceTracker();
         }
-        return CompileLayer.add(RT, std::move(TSM));
+        std::vector<std::string> Names;
+        TSM.withModuleDo([&Names](llvm::Module &M) {
+            for (const llvm::GlobalValue &GV: M.global_values()) {
+                if (GV.isDeclaration() == false and GV.hasLocalLinkage() == false) {
+                    Names.push_back(GV.getName().str());
+                }
+            }
+        });
+        for (auto &Name: Names) {
+            AddressCache.erase(Name);
+        }
+        if (auto Error = Layer.add(RT, std::move(TSM))) {
+            return Error;
+        }
+        // The default tracker is never removed, so its names need no record
+        if (RT != MainJD.getDefaultResourceTracker()) {
+            auto &Tracked = TrackedSymbols[RT.get()];
+            Tracked.insert(Tracked.end(), Names.begin(), Names.end());
+        }
+        return llvm::Error::success();
+    }
+
+public:
+    // Free the code added under RT
+    llvm::Error removeModule(llvm::orc::ResourceTrackerSP RT) {
+        auto Tracked = TrackedSymbols.find(RT.get());
+        if (Tracked != TrackedSymbols.end()) {
+            std::lock_guard<std::mutex> Lock(LoadedObjectsMutex);
+            for (auto &Name: Tracked->second) {
+                AddressCache.erase(Name);
+                ObjectMemory.erase((*Mangle(Name)).str());
+            }
+            TrackedSymbols.erase(Tracked);
+        }
+        if (RetainingCode) {
+            RetainedCode.push_back(std::move(RT));
+            return llvm::Error::success();
+        }
+        return RT->remove();
+    }
+
+    // Until releaseRetainedCode, removeModule keeps the code of the modules it removes: an abandoned
+    // evaluation (see Runtime::evaluateWithLimits) may still run in them. Their names stay defined.
+    void retainRemovedCode() {
+        RetainingCode = true;
+    }
+
+    llvm::Error releaseRetainedCode() {
+        RetainingCode = false;
+        llvm::Error Result = llvm::Error::success();
+        for (auto &RT: RetainedCode) {
+            Result = llvm::joinErrors(std::move(Result), RT->remove());
+        }
+        RetainedCode.clear();
+        return Result;
+    }
+
+    // Add the module M that defines function Name, under a tracker of its own. Name is renamed to a new
+    // version; a redefinition rebinds the stub to it and frees the previous version.
+    // Returns the symbol of the new version.
+    llvm::Expected<std::string> addDefinition(const std::string &Name, llvm::orc::ThreadSafeModule M) {
+        std::string Implementation = Name + "." + std::to_string(++NextVersion);
+        M.withModuleDo([&](llvm::Module &Module) {
+            Module.getFunction(Name)->setName(Implementation);
+        });
+        auto Tracker = MainJD.createResourceTracker();
+        if (auto Error = addModule(std::move(M), Tracker)) {
+            return std::move(Error);
+        }
+        if (auto Error = replaceVersion(Name, Implementation, Tracker)) {
+            return std::move(Error);
+        }
+        return Implementation;
+    }
+
+    // Like addDefinition, for a module that is only loaded (by Load) when the function is first called
+    llvm::Error addLazyDefinition(const std::string &Name, LazyModuleMaterializationUnit::ModuleLoader Load) {
+        std::string Implementation = Name + "." + std::to_string(++NextVersion);
+        llvm::orc::SymbolFlagsMap Flags;
+        Flags[Mangle(Implementation)] = llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable;
+        auto Tracker = MainJD.createResourceTracker();
+        auto Error = MainJD.define(std::make_unique<LazyModuleMaterializationUnit>(
+            TransformLayer, llvm::orc::MaterializationUnit::Interface(std::move(Flags), nullptr),
+            [Load = std::move(Load), Name, Implementation]() mutable -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+                auto M = Load();
+                if (M) {
+                    M->withModuleDo([&](llvm::Module &Module) {
+                        Module.getFunction(Name)->setName(Implementation);
+                    });
+                }
+                return M;
+            }), Tracker);
+        if (Error) {
+            return Error;
+        }
+        TrackedSymbols[Tracker.get()].push_back(Implementation);
+        return replaceVersion(Name, Implementation, Tracker);
+    }
+
+    bool isDefined(const std::string &Name) const {
+        return Versions.count(Name) != 0;
+    }
+
+    // f.N of the definition Name
+    const std::string &getImplementation(const std::string &Name) const {
+        return Versions.at(Name).Implementation;
+    }
+
+    // Point the stub of the definition Name at Entry, defined by M, instead of its current version:
+    // argument profiling or a specialization, which call the version themselves. Frees the previous entry;
+    // redefining Name frees this one. Like a redefinition, only safe while no JIT code runs.
+    llvm::Error setEntry(const std::string &Name, llvm::orc::ThreadSafeModule M, const std::string &Entry) {
+        auto Tracker = MainJD.createResourceTracker();
+        if (auto Error = addModule(std::move(M), Tracker)) {
+            return Error;
+        }
+        if (auto Error = bindStub(Name, Entry)) {
+            return Error;
+        }
+        return replaceEntry(Versions.at(Name), Tracker);
+    }
+
+    // Call the current version of Name directly again
+    llvm::Error clearEntry(const std::string &Name) {
+        DefinitionVersion &Version = Versions.at(Name);
+        if (auto Error = bindStub(Name, Version.Implementation)) {
+            return Error;
+        }
+        return replaceEntry(Version, nullptr);
+    }
+
+    // From now on, insert safepoints polling the words at StackLimit and StackSpan (in this process) into every
+    // module compiled, except those of addForeignModule. Modules already compiled keep running without them.
+    void enableSafepoints(uint64_t StackLimit, uint64_t StackSpan) {
+        Safepoints = true;
+        TransformLayer.setTransform([StackLimit, StackSpan](llvm::orc::ThreadSafeModule TSM,
+                                                            const llvm::orc::MaterializationResponsibility &)
+                                        -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+            TSM.withModuleDo([StackLimit, StackSpan](llvm::Module &M) {
+                InsertSafepoints(M, StackLimit, StackSpan);
+            });
+            return std::move(TSM);
+        });
+    }
+
+    // Memory of the current version of every definition, by name
+    std::map<std::string, MemoryUsage> getMemoryUsage() {
+        std::lock_guard<std::mutex> Lock(LoadedObjectsMutex);
+        std::map<std::string, MemoryUsage> Usage;
+        for (auto &[Name, Version]: Versions) {
+            auto Loaded = ObjectMemory.find((*Mangle(Version.Implementation)).str());
+            Usage[Name] = Loaded == ObjectMemory.end() ? MemoryUsage() : Loaded->second;
+        }
+        return Usage;
+    }
+
+    // Start compiling the modules that define Names on the thread pool and return at once;
+    // a later lookup of one of them waits for that compilation instead of starting another
+    void compileInBackground(llvm::ArrayRef<std::string> Names) {
+        llvm::orc::SymbolLookupSet Symbols;
+        for (auto &Name: Names) {
+            Symbols.add(Mangle(Name));
+        }
+        ES->lookup(llvm::orc::LookupKind::Static, llvm::orc::makeJITDylibSearchOrder({&MainJD}),
+                   std::move(Symbols), llvm::orc::SymbolState::Ready,
+                   [](llvm::Expected<llvm::orc::SymbolMap> Result) {
+                       // A failure (or a redefinition removing the module first) shows up again on the first call
+                       llvm::consumeError(Result.takeError());
+                   },
+                   llvm::orc::NoDependenciesToRegister);
     }
 
     // Symbol (Function, Variable) information
     llvm::Expected<llvm::orc::ExecutorSymbolDef> lookup(llvm::StringRef SymbolName) {
+        auto Cached = AddressCache.find(SymbolName);
+        if (Cached != AddressCache.end()) {
+            return Cached->second;
+        }
+        auto Symbol = ES->lookup({&MainJD}, Mangle(SymbolName.str()));
+        if (Symbol) {
+            AddressCache[SymbolName] = *Symbol;
+        }
+        return Symbol;
+    }
+
+    // Compile the versions the stubs of an executor process must target, and point the stubs there.
+    // A version that fails to compile leaves its stub at kal_compile_failed.
+    llvm::Error bindUnboundStubs() {
+        for (auto &[Name, Implementation]: UnboundStubs) {
+            auto Target = lookup(Implementation);
+            if (!Target) {
+                // The session already reported why; the previous version may be freed
+                llvm::consumeError(Target.takeError());
+                Target = ES->lookup({&RuntimeJD}, Mangle("kal_compile_failed"));
+                if (!Target) {
+                    return Target.takeError();
+                }
+            }
+            if (auto Error = Stubs->updatePointer(Name, Target->getAddress())) {
+                return Error;
+            }
+        }
+        UnboundStubs.clear();
+        return llvm::Error::success();
+    }
+
+    // Call the function Name, an `int32_t Name(int32_t, char **)` main, in the process running JIT code.
+    // Fails if Name does not compile or an executor process dies on the way.
+    llvm::Expected<int32_t> runAsMain(llvm::StringRef Name) {
+        if (auto Error = bindUnboundStubs()) {
+            return std::move(Error);
+        }
+        auto Symbol = lookup(Name);
+        if (!Symbol) {
+            return Symbol.takeError();
+        }
+        return ES->getExecutorProcessControl().runAsMain(Symbol->getAddress(), {});
+    }
+
+    // End the executor process at once, from any thread: the call it runs fails
+    void killExecutor() {
+#ifndef _WIN32
+        if (ExecutorProcess >= 0) {
+            kill(ExecutorProcess, SIGKILL);
+        }
+#endif
+    }
+
+    // lookup() without the address cache, for other threads than the main one
+    llvm::Expected<llvm::orc::ExecutorSymbolDef> lookupUncached(llvm::StringRef SymbolName) {
         return ES->lookup({&MainJD}, Mangle(SymbolName.str()));
     }
 };
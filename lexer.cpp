@@ -9,15 +9,35 @@ using namespace std;
 string IdentifierStr;
 double NumVal;
 
-int gettok() {
-    // pointer to currently checking character
-    static int LastChar = ' ';
+// pointer to currently checking character
+static int LastChar = ' ';
+
+// no token has been read on the current line yet
+static bool LineStart = true;
 
+int gettok() {
     // skip blank
     while (isspace(LastChar) != 0) {
+        if (LastChar == '\n' or LastChar == '\r') {
+            LineStart = true;
+        }
         LastChar = getchar();
     }
 
+    bool FirstOnLine = LineStart;
+    LineStart = false;
+
+    // process REPL command
+    if (LastChar == ':' and FirstOnLine) {
+        IdentifierStr.clear();
+        LastChar = getchar();
+        while (isalnum(LastChar) or LastChar == '-') {
+            IdentifierStr.push_back(LastChar);
+            LastChar = getchar();
+        }
+        return Token::tok_command;
+    }
+
     // process keyword (def, extern) and identifier
     if (isalpha(LastChar)) {
         IdentifierStr = LastChar;
@@ -121,3 +141,18 @@ int gettok() {
         return found_token;
     }
 }
+
+string getCommandArgument() {
+    string Argument;
+    while (LastChar != '\n' and LastChar != '\r' and LastChar != EOF) {
+        Argument.push_back(LastChar);
+        LastChar = getchar();
+    }
+
+    size_t Begin = Argument.find_first_not_of(" \t");
+    if (Begin == string::npos) {
+        return "";
+    }
+    size_t End = Argument.find_last_not_of(" \t");
+    return Argument.substr(Begin, End - Begin + 1);
+}
@@ -18,6 +18,9 @@ enum Token {
     // For loop
     tok_for = -9,
     tok_in = -10,
+
+    // REPL command (':' at the start of a line), name in IdentifierStr
+    tok_command = -11,
 };
 
 extern std::string IdentifierStr;
@@ -25,4 +28,7 @@ extern double NumVal;
 
 int gettok();
 
+// Rest of the current line without surrounding blanks (argument of a REPL command)
+std::string getCommandArgument();
+
 #endif
@@ -1,16 +1,836 @@
+#include "library.h"
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csetjmp>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h>
+#endif
+
+namespace {
+    // The evaluation of Runtime::evaluateWithLimits
+    std::atomic<bool> EvaluationRunning{false};
+    std::atomic<int> CancelReason{0}; // Runtime::EvaluationStatus of the first limit reached
+    std::atomic<unsigned int> AbandonedEvaluations{0}; // Still running, see Runtime::evaluateWithLimits
+    std::mutex StateMutex; // Orders AbandonedEvaluations with the kal_stack_span that depends on it
+
+    constexpr double PollSeconds = 0.05; // A cancel from a signal handler cannot wake a waiting thread
+
+    // kal_stack_span without a running evaluation: every safepoint is taken, or none
+    constexpr uint64_t AbandonedSpan = 1;
+    constexpr uint64_t IdleSpan = std::numeric_limits<uint64_t>::max();
+
+    // With StateMutex held
+    uint64_t idleSpan() {
+        return AbandonedEvaluations.load() != 0 ? AbandonedSpan : IdleSpan;
+    }
+
+    // Make every safepoint call kal_safepoint
+    void requestCancel(Runtime::EvaluationStatus Reason) {
+        int None = 0;
+        CancelReason.compare_exchange_strong(None, static_cast<int>(Reason));
+        kal_stack_span.store(0, std::memory_order_relaxed);
+    }
+
+    thread_local std::jmp_buf *SafepointExit = nullptr; // Where kal_safepoint leaves the evaluation thread
+    thread_local uint64_t SafepointStackLimit = 0; // The end of the stack of the evaluation on this thread
+    thread_local const std::atomic<bool> *EvaluationAbandoned = nullptr; // Of the evaluation on this thread
+
+    bool evaluationAbandoned() {
+        return EvaluationAbandoned != nullptr and EvaluationAbandoned->load();
+    }
+
+    // A limited evaluation that Runtime::evaluateWithLimits stopped waiting for leaves at its next runtime
+    // input call, instead of reading along with the REPL
+    void leaveIfAbandoned() {
+        if (evaluationAbandoned()) {
+            std::longjmp(*SafepointExit, 1);
+        }
+    }
+
+    // Output sink that writes to its stream only when full or flushed. Evaluation threads share it with the REPL;
+    // what an abandoned evaluation writes is discarded.
+    class OutputBuffer {
+        static constexpr size_t Capacity = 1 << 16;
+        static constexpr size_t MaxFormatted = 512; // longest fixed-point double plus newline
+
+        FILE *Stream;
+        std::mutex Mutex;
+        size_t Size = 0;
+        char Data[Capacity];
+
+        void flushLocked() {
+            if (Size != 0) {
+                fwrite(Data, 1, Size, Stream);
+                Size = 0;
+            }
+            fflush(Stream);
+        }
+
+        // Space for at least Length bytes
+        char *reserve(size_t Length) {
+            if (Size + Length > Capacity) {
+                flushLocked();
+            }
+            return Data + Size;
+        }
+
+        void commit(char *End) { Size = End - Data; }
+
+    public:
+        explicit OutputBuffer(FILE *Stream) : Stream(Stream) {
+        }
+
+        ~OutputBuffer() { flush(); }
+
+        void flush() {
+            std::lock_guard<std::mutex> Lock(Mutex);
+            flushLocked();
+        }
+
+        void put(char C) {
+            std::lock_guard<std::mutex> Lock(Mutex);
+            if (evaluationAbandoned()) {
+                return;
+            }
+            *reserve(1) = C;
+            ++Size;
+        }
+
+        void write(const void *Bytes, size_t Length) {
+            std::lock_guard<std::mutex> Lock(Mutex);
+            if (evaluationAbandoned()) {
+                return;
+            }
+            if (Length > Capacity) {
+                flushLocked();
+                fwrite(Bytes, 1, Length, Stream);
+                return;
+            }
+            memcpy(reserve(Length), Bytes, Length);
+            Size += Length;
+        }
+
+        // Same text as printf("%f\n")
+        void putFixed(double X, char Terminator = '\n') {
+            std::lock_guard<std::mutex> Lock(Mutex);
+            if (evaluationAbandoned()) {
+                return;
+            }
+            char *Begin = reserve(MaxFormatted);
+            auto Result = std::to_chars(Begin, Begin + MaxFormatted - 1, X, std::chars_format::fixed, 6);
+            *Result.ptr = Terminator;
+            commit(Result.ptr + 1);
+        }
+
+        // Shortest text that parses back to the same double
+        void putShortest(double X, char Terminator = '\n') {
+            std::lock_guard<std::mutex> Lock(Mutex);
+            if (evaluationAbandoned()) {
+                return;
+            }
+            char *Begin = reserve(MaxFormatted);
+            auto Result = std::to_chars(Begin, Begin + MaxFormatted - 1, X);
+            *Result.ptr = Terminator;
+            commit(Result.ptr + 1);
+        }
+    };
+
+    OutputBuffer &standardOutput() {
+        static OutputBuffer Buffer(stdout);
+        return Buffer;
+    }
+
+    OutputBuffer &standardError() {
+        static OutputBuffer Buffer(stderr);
+        return Buffer;
+    }
+
+    // Numbers for readd(): a memory mapped file, or stdin shared with the lexer
+    class InputReader {
+        const char *Begin = nullptr;
+        const char *Current = nullptr;
+        const char *End = nullptr;
 #ifdef _WIN32
-#define DLLEXPORT __declspec(dllexport)
+        std::vector<char> Contents;
+#endif
+
+        static bool isSeparator(int C) { return isspace(C) != 0 or C == ','; }
+
+        // getc(stdin), except that a limited evaluation waits for input in slices, and leaves when it is
+        // cancelled instead of blocking until the next line
+        static int getStandardInput() {
+#ifndef _WIN32
+            if (SafepointExit != nullptr) {
+                int Flags = fcntl(STDIN_FILENO, F_GETFL);
+                fcntl(STDIN_FILENO, F_SETFL, Flags | O_NONBLOCK);
+                int C;
+                while ((C = getc(stdin)) == EOF and ferror(stdin) and (errno == EAGAIN or errno == EWOULDBLOCK)) {
+                    clearerr(stdin);
+                    if (CancelReason.load() != 0 or evaluationAbandoned()) {
+                        fcntl(STDIN_FILENO, F_SETFL, Flags);
+                        std::longjmp(*SafepointExit, 1);
+                    }
+                    struct pollfd Input = {STDIN_FILENO, POLLIN, 0};
+                    poll(&Input, 1, static_cast<int>(PollSeconds * 1000));
+                }
+                fcntl(STDIN_FILENO, F_SETFL, Flags);
+                return C;
+            }
+#endif
+            return getc(stdin);
+        }
+
+        int peek() {
+            if (Begin != nullptr) {
+                return Current == End ? EOF : static_cast<unsigned char>(*Current);
+            }
+            int C = getStandardInput();
+            if (C != EOF) {
+                ungetc(C, stdin);
+            }
+            return C;
+        }
+
+        int next() {
+            if (Begin != nullptr) {
+                return Current == End ? EOF : static_cast<unsigned char>(*Current++);
+            }
+            return getStandardInput();
+        }
+
+    public:
+        ~InputReader() {
+#ifndef _WIN32
+            if (Begin != nullptr) {
+                munmap(const_cast<char *>(Begin), End - Begin);
+            }
+#endif
+        }
+
+        bool map(const char *Path) {
+#ifdef _WIN32
+            FILE *File = fopen(Path, "rb");
+            if (File == nullptr) {
+                return false;
+            }
+            char Chunk[1 << 16];
+            size_t Length;
+            while ((Length = fread(Chunk, 1, sizeof(Chunk), File)) != 0) {
+                Contents.insert(Contents.end(), Chunk, Chunk + Length);
+            }
+            fclose(File);
+            Contents.push_back('\n'); // keep Begin non-null for empty files
+            Begin = Current = Contents.data();
+            End = Begin + Contents.size();
+            return true;
 #else
-#define DLLEXPORT
+            int FD = open(Path, O_RDONLY);
+            if (FD < 0) {
+                return false;
+            }
+            struct stat Status;
+            if (fstat(FD, &Status) != 0) {
+                close(FD);
+                return false;
+            }
+            size_t Length = Status.st_size;
+            void *Mapped = mmap(nullptr, Length == 0 ? 1 : Length, PROT_READ, MAP_PRIVATE, FD, 0);
+            close(FD);
+            if (Mapped == MAP_FAILED) {
+                return false;
+            }
+            madvise(Mapped, Length, MADV_SEQUENTIAL);
+            Begin = Current = static_cast<const char *>(Mapped);
+            End = Begin + Length;
+            return true;
 #endif
+        }
+
+        bool atEnd() {
+            while (isSeparator(peek())) {
+                next();
+            }
+            return peek() == EOF;
+        }
+
+        double read() {
+            if (atEnd()) {
+                return std::numeric_limits<double>::quiet_NaN();
+            }
+            char Token[64];
+            size_t Length = 0;
+            while (peek() != EOF and isSeparator(peek()) == false) {
+                int C = next();
+                if (Length < sizeof(Token) - 1) {
+                    Token[Length++] = static_cast<char>(C);
+                }
+            }
+            Token[Length] = '\0';
+            return strtod(Token, nullptr);
+        }
+    };
+
+    InputReader &input() {
+        leaveIfAbandoned();
+        static InputReader Reader;
+        return Reader;
+    }
+
+    // Memo tables are shared by the threads evaluating top-level expressions (--eval-threads); each has a lock
+    std::mutex MemoCreationMutex; // Taken only to create a table
+    std::atomic<uint64_t> MemoBytes{0}; // Allocated by every memo table
+    std::atomic<uint64_t> MemoLimit{0}; // What MemoBytes may reach during a limited evaluation, 0 for no limit
+
+    // Open addressing hash table from argument bit patterns to results
+    class MemoTable {
+        static constexpr size_t MaxCapacity = size_t(1) << 21; // at most about a million entries at half load
+
+        uint64_t Arity;
+        size_t Capacity = 64; // power of two
+        size_t Size = 0;
+        std::vector<uint64_t> Keys; // Arity words per slot
+        std::vector<double> Results;
+        std::vector<uint8_t> Used;
+
+        size_t hash(const uint64_t *Key) const {
+            uint64_t Hash = 0x9E3779B97F4A7C15ull;
+            for (uint64_t i = 0; i < Arity; ++i) {
+                Hash = (Hash ^ Key[i]) * 0xFF51AFD7ED558CCDull;
+                Hash ^= Hash >> 32;
+            }
+            return Hash;
+        }
+
+        // Slot holding Key, or the empty slot where it belongs
+        size_t find(const uint64_t *Key) const {
+            size_t Slot = hash(Key) & (Capacity - 1);
+            while (Used[Slot] and memcmp(Keys.data() + Slot * Arity, Key, Arity * sizeof(uint64_t)) != 0) {
+                Slot = (Slot + 1) & (Capacity - 1);
+            }
+            return Slot;
+        }
+
+        uint64_t slotBytes() const {
+            return Arity * sizeof(uint64_t) + sizeof(double) + sizeof(uint8_t);
+        }
+
+        void grow() {
+            std::vector<uint64_t> OldKeys = std::move(Keys);
+            std::vector<double> OldResults = std::move(Results);
+            std::vector<uint8_t> OldUsed = std::move(Used);
+            size_t OldCapacity = Capacity;
+
+            Capacity *= 2;
+            Keys.assign(Capacity * Arity, 0);
+            Results.assign(Capacity, 0);
+            Used.assign(Capacity, 0);
+            for (size_t Slot = 0; Slot < OldCapacity; ++Slot) {
+                if (OldUsed[Slot]) {
+                    size_t NewSlot = find(OldKeys.data() + Slot * Arity);
+                    memcpy(Keys.data() + NewSlot * Arity, OldKeys.data() + Slot * Arity, Arity * sizeof(uint64_t));
+                    Results[NewSlot] = OldResults[Slot];
+                    Used[NewSlot] = 1;
+                }
+            }
+        }
+
+    public:
+        std::shared_mutex Mutex; // Shared by lookups, exclusive for inserts
+
+        explicit MemoTable(uint64_t Arity)
+            : Arity(Arity), Keys(Capacity * Arity), Results(Capacity), Used(Capacity) {
+        }
+
+        uint64_t bytes() const {
+            return Capacity * slotBytes();
+        }
+
+        // What the next insert allocates
+        uint64_t growthBytes() const {
+            return 2 * (Size + 1) > Capacity and Capacity < MaxCapacity ? Capacity * slotBytes() : 0;
+        }
+
+        bool lookup(const double *Arguments, double *Result) const {
+            size_t Slot = find(reinterpret_cast<const uint64_t *>(Arguments));
+            if (Used[Slot] == 0) {
+                return false;
+            }
+            *Result = Results[Slot];
+            return true;
+        }
+
+        void insert(const double *Arguments, double Result) {
+            const auto *Key = reinterpret_cast<const uint64_t *>(Arguments);
+            size_t Slot = find(Key);
+            if (Used[Slot] == 0) {
+                if (2 * (Size + 1) > Capacity) {
+                    // A full table keeps what it has: other results are computed again
+                    if (Capacity >= MaxCapacity) {
+                        return;
+                    }
+                    grow();
+                    Slot = find(Key);
+                }
+                memcpy(Keys.data() + Slot * Arity, Key, Arity * sizeof(uint64_t));
+                Used[Slot] = 1;
+                ++Size;
+            }
+            Results[Slot] = Result;
+        }
+    };
+
+    const Runtime::RuntimeFunction RuntimeFunctions[] = {
+        {"putchard", 1, Runtime::Effect::IO},
+        {"printd", 1, Runtime::Effect::IO},
+        {"outchard", 1, Runtime::Effect::IO},
+        {"outd", 1, Runtime::Effect::IO},
+        {"outbind", 1, Runtime::Effect::IO},
+        {"flushd", 0, Runtime::Effect::IO},
+        {"readd", 0, Runtime::Effect::IO},
+        {"eofd", 0, Runtime::Effect::IO},
+    };
+}
 
 extern "C" DLLEXPORT double putchard(double X) {
-    fputc((char) X, stderr);
+    standardError().put((char) X);
     return 0;
 }
 
 extern "C" DLLEXPORT double printd(double X) {
-    fprintf(stderr, "%f\n", X);
+    standardError().putFixed(X);
+    return 0;
+}
+
+extern "C" DLLEXPORT double outchard(double X) {
+    standardOutput().put((char) X);
+    return 0;
+}
+
+extern "C" DLLEXPORT double outd(double X) {
+    standardOutput().putShortest(X);
+    return 0;
+}
+
+extern "C" DLLEXPORT double outbind(double X) {
+    standardOutput().write(&X, sizeof(X));
+    return 0;
+}
+
+extern "C" DLLEXPORT double flushd() {
+    Runtime::flushOutput();
     return 0;
 }
+
+extern "C" DLLEXPORT double readd() {
+    return input().read();
+}
+
+extern "C" DLLEXPORT double eofd() {
+    return input().atEnd() ? 1 : 0;
+}
+
+extern "C" DLLEXPORT void writedoubles(const double *Values, size_t Count) {
+    standardOutput().write(Values, Count * sizeof(double));
+}
+
+extern "C" DLLEXPORT double kal_print_vector(const double *Lanes, uint64_t Count) {
+    std::string Text = Runtime::formatValues(Lanes, Count) + '\n';
+    standardError().write(Text.data(), Text.size());
+    return 0;
+}
+
+extern "C" DLLEXPORT double kal_write_vector(const double *Lanes, uint64_t Count) {
+    for (uint64_t i = 0; i < Count; ++i) {
+        standardOutput().putShortest(Lanes[i], i + 1 == Count ? '\n' : ' ');
+    }
+    return 0;
+}
+
+// The table of a memo function, in the pointer the generated code passes: null until its first insert
+static std::atomic<void *> &memoTableSlot(void **Table) {
+    return *reinterpret_cast<std::atomic<void *> *>(Table);
+}
+
+extern "C" DLLEXPORT int kal_memo_lookup(void **Table, const double *Arguments, double *Result) {
+    auto *Memo = static_cast<MemoTable *>(memoTableSlot(Table).load(std::memory_order_acquire));
+    if (Memo == nullptr) {
+        return 0;
+    }
+    std::shared_lock<std::shared_mutex> Lock(Memo->Mutex);
+    return Memo->lookup(Arguments, Result) ? 1 : 0;
+}
+
+extern "C" DLLEXPORT void kal_memo_insert(void **Table, const double *Arguments, uint64_t Count, double Result) {
+    auto *Memo = static_cast<MemoTable *>(memoTableSlot(Table).load(std::memory_order_acquire));
+    if (Memo == nullptr) {
+        std::lock_guard<std::mutex> Lock(MemoCreationMutex);
+        Memo = static_cast<MemoTable *>(memoTableSlot(Table).load(std::memory_order_acquire));
+        if (Memo == nullptr) {
+            Memo = new MemoTable(Count);
+            MemoBytes.fetch_add(Memo->bytes());
+            memoTableSlot(Table).store(Memo, std::memory_order_release);
+        }
+    }
+    std::unique_lock<std::shared_mutex> Lock(Memo->Mutex);
+    // --eval-memory: the table stays as it is and the evaluation stops at its next safepoint
+    uint64_t Growth = Memo->growthBytes();
+    if (Growth != 0) {
+        uint64_t Limit = MemoLimit.load();
+        uint64_t Before = MemoBytes.fetch_add(Growth);
+        if (Limit != 0 and Before + Growth > Limit) {
+            MemoBytes.fetch_sub(Growth);
+            // The limit is of a later evaluation than an abandoned one
+            if (evaluationAbandoned() == false) {
+                requestCancel(Runtime::EvaluationStatus::MemoLimitReached);
+            }
+            return;
+        }
+    }
+    Memo->insert(Arguments, Result);
+}
+
+extern "C" DLLEXPORT void kal_profile_arguments(std::atomic<uint64_t> *Profile, const double *Arguments,
+                                                uint64_t Count) {
+    // Relaxed loads and stores instead of read-modify-write: calls on several threads (--eval-threads)
+    // may lose a count, which a profile can afford, but never tear one
+    auto Increment = [](std::atomic<uint64_t> &Counter) {
+        Counter.store(Counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    };
+    Increment(Profile[0]);
+    for (uint64_t i = 0; i < Count; ++i) {
+        uint64_t Bits;
+        memcpy(&Bits, &Arguments[i], sizeof(Bits));
+        std::atomic<uint64_t> &Candidate = Profile[1 + 3 * i], &Votes = Profile[2 + 3 * i];
+        std::atomic<uint64_t> &Matches = Profile[3 + 3 * i];
+
+        // Boyer-Moore majority vote: the candidate is the value of most calls if one has a majority
+        if (Candidate.load(std::memory_order_relaxed) == Bits) {
+            Increment(Votes);
+            Increment(Matches);
+        } else if (Votes.load(std::memory_order_relaxed) == 0) {
+            Candidate.store(Bits, std::memory_order_relaxed);
+            Votes.store(1, std::memory_order_relaxed);
+        } else {
+            Votes.store(Votes.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+        }
+    }
+}
+
+// x86-64 psABI levels: every feature of a level, and for v3/v4 the vector registers saved by the OS (XCR0)
+extern "C" DLLEXPORT int kal_cpu_level() {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    unsigned int A, B, C, D;
+    if (__get_cpuid(1, &A, &B, &C, &D) == 0) {
+        return 1;
+    }
+    unsigned int Leaf1C = C;
+    unsigned int Leaf7B = __get_cpuid_count(7, 0, &A, &B, &C, &D) ? B : 0;
+    unsigned int Extended1C = __get_cpuid(0x80000001, &A, &B, &C, &D) ? C : 0;
+    auto Has = [](unsigned int Register, unsigned int Bit) {
+        return ((Register >> Bit) & 1) != 0;
+    };
+
+    // CMPXCHG16B, LAHF/SAHF, POPCNT, SSE3, SSE4.1, SSE4.2, SSSE3
+    if (!(Has(Leaf1C, 13) && Has(Extended1C, 0) && Has(Leaf1C, 23) && Has(Leaf1C, 0) && Has(Leaf1C, 19) &&
+          Has(Leaf1C, 20) && Has(Leaf1C, 9))) {
+        return 1;
+    }
+
+    // OSXSAVE, then XGETBV: XMM and YMM state (bits 1, 2), opmask and ZMM state (bits 5 to 7)
+    uint64_t XCR0 = 0;
+    if (Has(Leaf1C, 27)) {
+        unsigned int Low, High;
+        __asm__("xgetbv" : "=a"(Low), "=d"(High) : "c"(0));
+        XCR0 = (uint64_t(High) << 32) | Low;
+    }
+
+    // AVX, AVX2, BMI1, BMI2, F16C, FMA, LZCNT, MOVBE, OSXSAVE
+    if (!(Has(Leaf1C, 28) && Has(Leaf7B, 5) && Has(Leaf7B, 3) && Has(Leaf7B, 8) && Has(Leaf1C, 29) &&
+          Has(Leaf1C, 12) && Has(Extended1C, 5) && Has(Leaf1C, 22) && (XCR0 & 0x6) == 0x6)) {
+        return 2;
+    }
+
+    // AVX512F, AVX512BW, AVX512CD, AVX512DQ, AVX512VL
+    if (!(Has(Leaf7B, 16) && Has(Leaf7B, 30) && Has(Leaf7B, 28) && Has(Leaf7B, 17) && Has(Leaf7B, 31) &&
+          (XCR0 & 0xE6) == 0xE6)) {
+        return 3;
+    }
+    return 4;
+#else
+    return 1;
+#endif
+}
+
+extern "C" DLLEXPORT void kal_print_result(const double *Values, uint64_t Lanes) {
+    Runtime::flushOutput(); // keep runtime output ahead of the result
+    std::string Text = Runtime::formatResult(Values, Lanes);
+    standardError().write(Text.data(), Text.size());
+    Runtime::flushOutput();
+}
+
+extern "C" DLLEXPORT double kal_compile_failed() {
+    fprintf(stderr, "Error: function failed to compile\n");
+    return std::numeric_limits<double>::quiet_NaN();
+}
+
+std::atomic<uint64_t> kal_stack_limit{0};
+std::atomic<uint64_t> kal_stack_span{IdleSpan};
+
+extern "C" DLLEXPORT void kal_safepoint() {
+    // Other threads (:bench, argument specialization) get here while a limited evaluation runs
+    if (SafepointExit == nullptr) {
+        return;
+    }
+    // An abandoned evaluation leaves without cancelling the one that may run now
+    if (evaluationAbandoned() == false) {
+        char Frame;
+        if (reinterpret_cast<uintptr_t>(&Frame) < SafepointStackLimit) {
+            requestCancel(Runtime::EvaluationStatus::StackExhausted); // unless a limit was reached first
+        } else if (CancelReason.load() == 0) {
+            return; // The span of a later evaluation, seen before the abandon: the next poll leaves
+        }
+    }
+    std::longjmp(*SafepointExit, 1);
+}
+
+namespace {
+    constexpr uint64_t DefaultStackBytes = 8 << 20;
+    constexpr uint64_t SafepointMargin = 256 << 10; // Stack left below the limit, for runtime functions
+    constexpr double AbandonSeconds = 1; // Given to a cancelled evaluation to reach a safepoint
+
+    // Shared by the waiting thread and the evaluation thread, which may outlive evaluateWithLimits
+    struct Evaluation {
+        void (*Evaluate)(void *);
+        void *Context;
+        uint64_t StackBytes;
+        bool Completed = false; // Evaluate returned instead of leaving at a safepoint
+        bool Done = false;
+        std::atomic<bool> Abandoned{false}; // Nothing waits for it any more
+        std::mutex Mutex;
+        std::condition_variable Finished;
+    };
+
+    void runEvaluation(std::shared_ptr<Evaluation> E) {
+        std::jmp_buf Exit;
+        if (setjmp(Exit) == 0) {
+            SafepointExit = &Exit;
+            EvaluationAbandoned = &E->Abandoned;
+            // The stack grows down from about here
+            SafepointStackLimit = reinterpret_cast<uintptr_t>(&Exit) - E->StackBytes;
+            {
+                // Unless it was abandoned before it got here, or a cancel (span 0) came first
+                std::lock_guard<std::mutex> State(StateMutex);
+                if (E->Abandoned.load() == false) {
+                    kal_stack_limit.store(SafepointStackLimit);
+                    uint64_t Span = kal_stack_span.load();
+                    while (Span != 0 and kal_stack_span.compare_exchange_weak(Span, E->StackBytes) == false) {
+                    }
+                }
+            }
+            E->Evaluate(E->Context);
+            E->Completed = true;
+        }
+        SafepointExit = nullptr;
+        SafepointStackLimit = 0;
+        EvaluationAbandoned = nullptr;
+        std::lock_guard<std::mutex> Lock(E->Mutex);
+        E->Done = true;
+        if (E->Abandoned.load()) {
+            // Safepoints need not be taken any more, unless by another abandoned evaluation or a running one
+            std::lock_guard<std::mutex> State(StateMutex);
+            if (AbandonedEvaluations.fetch_sub(1) == 1) {
+                uint64_t Span = AbandonedSpan;
+                kal_stack_span.compare_exchange_strong(Span, IdleSpan);
+            }
+        } else {
+            E->Finished.notify_one();
+        }
+    }
+}
+
+Runtime::EvaluationStatus Runtime::evaluateWithLimits(void (*Evaluate)(void *), void *Context,
+                                                      const EvaluationLimits &Limits) {
+    auto E = std::make_shared<Evaluation>();
+    E->Evaluate = Evaluate;
+    E->Context = Context;
+    E->StackBytes = Limits.StackBytes != 0 ? Limits.StackBytes : DefaultStackBytes;
+    MemoLimit.store(Limits.MemoBytes != 0 ? MemoBytes.load() + Limits.MemoBytes : 0);
+    CancelReason.store(0);
+    EvaluationRunning.store(true);
+
+    // A thread of its own: the stack size is known, and this one can wait with a timeout
+    std::thread Thread;
+#ifndef _WIN32
+    pthread_attr_t Attributes;
+    pthread_attr_init(&Attributes);
+    pthread_attr_setstacksize(&Attributes, E->StackBytes + SafepointMargin);
+    pthread_t PosixThread;
+    auto *Argument = new std::shared_ptr<Evaluation>(E);
+    bool Started = pthread_create(&PosixThread, &Attributes, [](void *Argument) -> void * {
+        auto *Shared = static_cast<std::shared_ptr<Evaluation> *>(Argument);
+        runEvaluation(std::move(*Shared));
+        delete Shared;
+        return nullptr;
+    }, Argument) == 0;
+    pthread_attr_destroy(&Attributes);
+    if (Started == false) {
+        delete Argument;
+    }
+#else
+    bool Started = false;
+#endif
+    if (Started == false) {
+        // The default stack: 1 MiB on Windows
+        E->StackBytes = std::min<uint64_t>(E->StackBytes, (1 << 20) - SafepointMargin);
+        Thread = std::thread(runEvaluation, E);
+    }
+
+    // Until it returns or is cancelled, then a bounded wait for it to reach a safepoint: a library call in
+    // progress (a long libm call, a write to a full pipe) cannot be interrupted, readd() on stdin polls for the
+    // cancel. If it does not return in time, it is abandoned: it runs on, its result and output are
+    // discarded, and it leaves at its next safepoint or runtime input call.
+    bool Abandoned = false;
+    {
+        std::unique_lock<std::mutex> Lock(E->Mutex);
+        auto Done = [&E] { return E->Done; };
+        auto Start = std::chrono::steady_clock::now();
+        while (E->Done == false and CancelReason.load() == 0) {
+            E->Finished.wait_for(Lock, std::chrono::duration<double>(PollSeconds), Done);
+            if (Limits.Timeout > 0 and E->Done == false and
+                std::chrono::steady_clock::now() - Start >= std::chrono::duration<double>(Limits.Timeout)) {
+                requestCancel(EvaluationStatus::TimedOut);
+            }
+        }
+        if (E->Finished.wait_for(Lock, std::chrono::duration<double>(AbandonSeconds), Done) == false) {
+            AbandonedEvaluations.fetch_add(1);
+            E->Abandoned.store(true);
+            Abandoned = true;
+        }
+    }
+    if (Thread.joinable()) {
+        if (Abandoned) {
+            Thread.detach();
+        } else {
+            Thread.join();
+        }
+    }
+#ifndef _WIN32
+    if (Started) {
+        if (Abandoned) {
+            pthread_detach(PosixThread);
+        } else {
+            pthread_join(PosixThread, nullptr);
+        }
+    }
+#endif
+
+    EvaluationRunning.store(false);
+    {
+        std::lock_guard<std::mutex> State(StateMutex);
+        kal_stack_limit.store(0);
+        kal_stack_span.store(idleSpan());
+    }
+    MemoLimit.store(0);
+    int Reason = CancelReason.exchange(0);
+    if (Abandoned) {
+        return EvaluationStatus::Abandoned;
+    }
+    return E->Completed ? EvaluationStatus::Finished : static_cast<EvaluationStatus>(Reason);
+}
+
+bool Runtime::cancelEvaluation() {
+    if (EvaluationRunning.load() == false) {
+        return false;
+    }
+    requestCancel(EvaluationStatus::Interrupted);
+    return true;
+}
+
+bool Runtime::hasAbandonedEvaluation() {
+    return AbandonedEvaluations.load() != 0;
+}
+
+const std::vector<std::pair<const char *, const void *> > &Runtime::getSymbols() {
+    static const std::vector<std::pair<const char *, const void *> > Symbols = {
+        {"putchard", reinterpret_cast<const void *>(&putchard)},
+        {"printd", reinterpret_cast<const void *>(&printd)},
+        {"outchard", reinterpret_cast<const void *>(&outchard)},
+        {"outd", reinterpret_cast<const void *>(&outd)},
+        {"outbind", reinterpret_cast<const void *>(&outbind)},
+        {"flushd", reinterpret_cast<const void *>(&flushd)},
+        {"readd", reinterpret_cast<const void *>(&readd)},
+        {"eofd", reinterpret_cast<const void *>(&eofd)},
+        {"kal_print_vector", reinterpret_cast<const void *>(&kal_print_vector)},
+        {"kal_write_vector", reinterpret_cast<const void *>(&kal_write_vector)},
+        {"kal_memo_lookup", reinterpret_cast<const void *>(&kal_memo_lookup)},
+        {"kal_memo_insert", reinterpret_cast<const void *>(&kal_memo_insert)},
+        {"kal_profile_arguments", reinterpret_cast<const void *>(&kal_profile_arguments)},
+        {"kal_cpu_level", reinterpret_cast<const void *>(&kal_cpu_level)},
+        {"kal_print_result", reinterpret_cast<const void *>(&kal_print_result)},
+        {"kal_compile_failed", reinterpret_cast<const void *>(&kal_compile_failed)},
+        {"kal_safepoint", reinterpret_cast<const void *>(&kal_safepoint)},
+    };
+    return Symbols;
+}
+
+const Runtime::RuntimeFunction *Runtime::findRuntimeFunction(const std::string &Name) {
+    for (auto &Function: RuntimeFunctions) {
+        if (Name == Function.Name) {
+            return &Function;
+        }
+    }
+    return nullptr;
+}
+
+bool Runtime::setInputFile(const char *Path) {
+    return input().map(Path);
+}
+
+std::string Runtime::formatValues(const double *Values, uint64_t Lanes) {
+    char Buffer[512]; // longest fixed-point double
+    auto appendFixed = [&Buffer](std::string &Text, double X) {
+        auto Result = std::to_chars(Buffer, Buffer + sizeof(Buffer), X, std::chars_format::fixed, 6);
+        Text.append(Buffer, Result.ptr);
+    };
+    std::string Text;
+    if (Lanes == 0) {
+        appendFixed(Text, Values[0]);
+        return Text;
+    }
+    Text += '[';
+    for (uint64_t i = 0; i < Lanes; ++i) {
+        appendFixed(Text, Values[i]);
+        Text += i + 1 == Lanes ? "]" : ", ";
+    }
+    return Text;
+}
+
+std::string Runtime::formatResult(const double *Values, uint64_t Lanes) {
+    return "Evaluated to " + formatValues(Values, Lanes) + "\n";
+}
+
+void Runtime::flushOutput() {
+    standardOutput().flush();
+    standardError().flush();
+}
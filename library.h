@@ -0,0 +1,125 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+// Runtime functions callable from Kaleidoscope through `extern`
+extern "C" {
+    DLLEXPORT double putchard(double X); // character to buffered stderr
+    DLLEXPORT double printd(double X); // "%f\n" to buffered stderr
+    DLLEXPORT double outchard(double X); // character to buffered stdout
+    DLLEXPORT double outd(double X); // shortest round-trip text to buffered stdout
+    DLLEXPORT double outbind(double X); // raw 8 bytes to buffered stdout
+    DLLEXPORT double flushd(); // flush stdout and stderr buffers
+    DLLEXPORT double readd(); // next number from input, NaN at end of input
+    DLLEXPORT double eofd(); // 1 if input has no more numbers
+
+    // Host side: raw doubles to buffered stdout
+    DLLEXPORT void writedoubles(const double *Values, size_t Count);
+
+    // Vector values cross the C ABI through memory: printv(v) and outv(v) store the lanes and call these
+    DLLEXPORT double kal_print_vector(const double *Lanes, uint64_t Count); // "[a, b, ...]\n" to buffered stderr
+    DLLEXPORT double kal_write_vector(const double *Lanes, uint64_t Count); // shortest text to buffered stdout
+
+    // Cache behind `def memo` functions; *Table is created on first use with Count arguments per entry.
+    // A table stops growing at about a million entries: later results are computed again on every call.
+    DLLEXPORT int kal_memo_lookup(void **Table, const double *Arguments, double *Result);
+    DLLEXPORT void kal_memo_insert(void **Table, const double *Arguments, uint64_t Count, double Result);
+
+    // Argument value profile of a definition (--specialize). Profile holds the number of calls, then for each of
+    // the Count arguments the majority vote candidate (as bits), its votes and the calls that matched it.
+    DLLEXPORT void kal_profile_arguments(std::atomic<uint64_t> *Profile, const double *Arguments, uint64_t Count);
+
+    // x86-64 micro-architecture level of this CPU (1 to 4), picks the --multiversion clone to run
+    DLLEXPORT int kal_cpu_level();
+
+    // Executor process (--executor): print the result of a top-level expression (Lanes 0 for a number),
+    // and the stand-in for a definition that failed to compile
+    DLLEXPORT void kal_print_result(const double *Values, uint64_t Lanes);
+    DLLEXPORT double kal_compile_failed();
+
+    // Safepoints (see InsertSafepoints): generated code calls kal_safepoint when its frame address is not
+    // within kal_stack_span bytes above kal_stack_limit. While a limited evaluation runs, that is the stack of
+    // its thread; the span is 0 to cancel it, 1 while only abandoned evaluations run (they leave), and the
+    // maximum while none runs.
+    DLLEXPORT extern std::atomic<uint64_t> kal_stack_limit;
+    DLLEXPORT extern std::atomic<uint64_t> kal_stack_span;
+    DLLEXPORT void kal_safepoint();
+}
+
+namespace Runtime {
+    // What a runtime function may touch, used to attach LLVM attributes to its declaration
+    enum class Effect {
+        None, // result depends only on the arguments
+        IO, // reads or writes the runtime I/O buffers
+    };
+
+    struct RuntimeFunction {
+        const char *Name;
+        unsigned int Arity;
+        Effect Effects;
+    };
+
+    // nullptr if Name is not a runtime function
+    const RuntimeFunction *findRuntimeFunction(const std::string &Name);
+
+    // Name and address of every runtime function generated code may call, bound into the JIT up front
+    const std::vector<std::pair<const char *, const void *> > &getSymbols();
+
+    // Read readd() input from a memory mapped file instead of stdin
+    bool setInputFile(const char *Path);
+
+    void flushOutput();
+
+    // Values as printd and printv write them: "x" for a number (Lanes 0), "[a, b, ...]" for a vector
+    std::string formatValues(const double *Values, uint64_t Lanes);
+
+    // "Evaluated to <values>\n", the line printed for the result of a top-level expression
+    std::string formatResult(const double *Values, uint64_t Lanes);
+
+    // --timeout, --eval-stack and --eval-memory
+    struct EvaluationLimits {
+        double Timeout = 0; // Seconds of wall-clock time, 0 for none
+        uint64_t StackBytes = 0; // Stack of the evaluation thread, 0 for 8 MiB
+        uint64_t MemoBytes = 0; // Growth of `memo` caches during the evaluation, 0 for none
+
+        bool enabled() const {
+            return Timeout > 0 or StackBytes > 0 or MemoBytes > 0;
+        }
+    };
+
+    enum class EvaluationStatus {
+        Finished,
+        TimedOut,
+        Interrupted, // cancelEvaluation
+        StackExhausted,
+        MemoLimitReached,
+        Abandoned, // Cancelled, but still in a runtime or library call a second later
+    };
+
+    // Call Evaluate(Context) on a thread of its own within Limits. When a limit is reached, the generated code
+    // leaves the call at its next safepoint, so Evaluate must own nothing that needs destroying. Calls into
+    // libraries (libm, a write to a full pipe) cannot be interrupted: if the call has not left a second after
+    // the cancel, it is abandoned and runs on, and leaves at its next safepoint or runtime input call, even while
+    // later evaluations run; its output is discarded. Context and the code it calls must stay valid until then.
+    EvaluationStatus evaluateWithLimits(void (*Evaluate)(void *), void *Context, const EvaluationLimits &Limits);
+
+    // Cancel the evaluation of evaluateWithLimits; false if none runs. Safe in a signal handler.
+    bool cancelEvaluation();
+
+    // An evaluation abandoned by evaluateWithLimits has not left yet
+    bool hasAbandonedEvaluation();
+}
+
+#endif
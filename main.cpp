@@ -1,19 +1,217 @@
+#include <algorithm>
+#include <csignal>
 #include <iostream>
+#include <thread>
 #include "parser.h"
 #include "codegen.h"
+#include "library.h"
+#include "aot.h"
+#include "snapshot.h"
+#include "irimport.h"
+#include "specialize.h"
 
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/TargetSelect.h"
 
+static llvm::cl::opt<std::string> InputFile("input",
+                                            llvm::cl::desc("Read readd() numbers from a memory mapped file"),
+                                            llvm::cl::value_desc("file"));
+
+static llvm::cl::opt<std::string> OutputFile("o",
+                                             llvm::cl::desc("Compile ahead of time to an object file, to a shared "
+                                                 "library if the name ends in .so/.dylib, or to LLVM IR for .ll"),
+                                             llvm::cl::value_desc("file"));
+
+static llvm::cl::opt<std::string> HeaderFile("header",
+                                             llvm::cl::desc("Compile ahead of time and write a C header with the "
+                                                 "prototypes of all definitions"),
+                                             llvm::cl::value_desc("file"));
+
+static llvm::cl::opt<std::string> LinkerProgram("linker",
+                                                llvm::cl::desc("Compiler driver used to link shared libraries"),
+                                                llvm::cl::value_desc("program"),
+                                                llvm::cl::init(KALEIDOSCOPE_LINKER));
+
+static llvm::cl::opt<std::string> RuntimeLibrary("runtime",
+                                                 llvm::cl::desc("Runtime library linked into shared libraries"),
+                                                 llvm::cl::value_desc("file"),
+                                                 llvm::cl::init(KALEIDOSCOPE_RUNTIME_LIBRARY));
+
+static llvm::cl::opt<std::string> SnapshotFile("snapshot",
+                                               llvm::cl::desc("Load the definitions of a session snapshot at startup"),
+                                               llvm::cl::value_desc("file"));
+
+static llvm::cl::list<std::string> IRFiles(llvm::cl::Positional,
+                                           llvm::cl::desc("<LLVM IR (.ll) or bitcode (.bc) files whose functions "
+                                               "can be called>"));
+
+static llvm::cl::opt<ASTNode::FloatingPointMode, true> FPMode(
+    "fp-mode", llvm::cl::desc("Floating-point semantics of definitions without a strict/contract/fast qualifier"),
+    llvm::cl::location(DefaultFloatingPointMode),
+    llvm::cl::values(
+        clEnumValN(ASTNode::FloatingPointMode::Strict, "strict", "IEEE semantics (default)"),
+        clEnumValN(ASTNode::FloatingPointMode::Contract, "contract", "Allow fusing multiply and add"),
+        clEnumValN(ASTNode::FloatingPointMode::Fast, "fast", "All fast-math flags")));
+
+static llvm::cl::opt<char> DefinitionOptLevel("O",
+                                             llvm::cl::desc("Optimization level of definitions (and of the whole "
+                                                 "module in AOT mode): -O0, -O1, -O2, -O3, -Os or -Oz (default -O2)"),
+                                             llvm::cl::Prefix, llvm::cl::init('2'));
+
+static llvm::cl::opt<char> ExpressionOptLevel("expr-O",
+                                              llvm::cl::desc("Optimization level of top-level expressions, which "
+                                                  "only run once: -expr-O0 ... -expr-Oz (default -expr-O1)"),
+                                              llvm::cl::Prefix, llvm::cl::init('1'));
+
+static llvm::cl::opt<std::string> TargetCPU("mcpu",
+                                            llvm::cl::desc("CPU to generate code for: a name like x86-64-v3, or "
+                                                "native (default: the host in the REPL, generic in AOT mode)"),
+                                            llvm::cl::value_desc("cpu"));
+
+static llvm::cl::list<std::string> TargetFeatures("mattr",
+                                                  llvm::cl::desc("CPU features to add or remove, e.g. "
+                                                      "-mattr=+avx2,-avx512f"),
+                                                  llvm::cl::value_desc("features"), llvm::cl::CommaSeparated);
+
+static llvm::cl::opt<bool> Multiversion("multiversion",
+                                        llvm::cl::desc("AOT mode: compile every function for x86-64-v2, v3 and v4 "
+                                            "too and pick the best version for the CPU at load time"));
+
+static llvm::cl::opt<bool> Pipeline("pipeline",
+                                    llvm::cl::desc("Compile definitions on worker threads and, with --input or in "
+                                        "AOT mode, parse ahead on another thread"));
+
+static llvm::cl::opt<unsigned int, true> EvalThreads("eval-threads",
+                                                  llvm::cl::desc("Compile and evaluate up to N top-level expressions "
+                                                      "without I/O at once on worker threads; results are still "
+                                                      "printed in program order (default 0: one by one)"),
+                                                  llvm::cl::value_desc("N"), llvm::cl::location(EvaluationThreads));
+
+static llvm::cl::opt<bool, true> Specialize("specialize",
+                                           llvm::cl::desc("Profile the number arguments of definitions and "
+                                               "specialize them for values that (almost) never change"),
+                                           llvm::cl::location(ArgumentSpecialization));
+
+static llvm::cl::opt<std::string> ExecutorProgram("executor",
+                                                  llvm::cl::desc("Run JIT-compiled code in a separate process "
+                                                      "started from <program> (default: kaleidoscope-executor), "
+                                                      "restarted with the session's definitions if it dies"),
+                                                  llvm::cl::value_desc("program"), llvm::cl::ValueOptional);
+
+static llvm::cl::opt<double> Timeout("timeout",
+                                     llvm::cl::desc("Cancel a top-level expression still running after <seconds> "
+                                         "(default: none)"),
+                                     llvm::cl::value_desc("seconds"), llvm::cl::init(0));
+
+static llvm::cl::opt<unsigned int> EvalStack("eval-stack",
+                                             llvm::cl::desc("Stack of a top-level expression in MiB, deeper "
+                                                 "recursion is cancelled (default 8 with --timeout or "
+                                                 "--eval-memory)"),
+                                             llvm::cl::value_desc("MiB"), llvm::cl::init(0));
+
+static llvm::cl::opt<unsigned int> EvalMemory("eval-memory",
+                                              llvm::cl::desc("Cancel a top-level expression whose memo caches "
+                                                  "grow by more than <MiB> (default: no limit)"),
+                                              llvm::cl::value_desc("MiB"), llvm::cl::init(0));
+
 int main(int argc, char *argv[]) {
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
+
+    if (InputFile.empty() == false and Runtime::setInputFile(InputFile.c_str()) == false) {
+        fprintf(stderr, "Error: cannot open input file '%s'\n", InputFile.c_str());
+        return 1;
+    }
+
+    auto DefinitionLevel = parseOptimizationLevel(DefinitionOptLevel);
+    auto ExpressionLevel = parseOptimizationLevel(ExpressionOptLevel);
+    if (!DefinitionLevel or !ExpressionLevel) {
+        fprintf(stderr, "Error: optimization level must be 0, 1, 2, 3, s or z\n");
+        return 1;
+    }
+    DefinitionOptimizationLevel = *DefinitionLevel;
+    ExpressionOptimizationLevel = *ExpressionLevel;
+
+    if (Timeout < 0) {
+        fprintf(stderr, "Error: --timeout must not be negative\n");
+        return 1;
+    }
+    EvaluationLimits.Timeout = Timeout;
+    EvaluationLimits.StackBytes = static_cast<uint64_t>(EvalStack) << 20;
+    EvaluationLimits.MemoBytes = static_cast<uint64_t>(EvalMemory) << 20;
+    // Limited evaluations run one at a time; an executor process can only be ended
+    if (EvaluationLimits.enabled() and EvaluationThreads > 0) {
+        fprintf(stderr, "Error: --eval-threads cannot be combined with --timeout, --eval-stack or --eval-memory\n");
+        return 1;
+    }
+    if ((EvalStack > 0 or EvalMemory > 0) and ExecutorProgram.getNumOccurrences() > 0) {
+        fprintf(stderr, "Error: --eval-stack and --eval-memory need the code in this process\n");
+        return 1;
+    }
+
     // Set target
     llvm::InitializeNativeTarget();
     llvm::InitializeNativeTargetAsmPrinter();
     llvm::InitializeNativeTargetAsmParser();
 
+    bool AheadOfTime = OutputFile.empty() == false or HeaderFile.empty() == false;
+
+    // Without --input, readd() reads stdin between statements, so the parser must not read ahead of it
+    bool ParseAhead = Pipeline and (AheadOfTime or InputFile.empty() == false);
+    unsigned int CompileThreads = Pipeline ? std::max(1u, std::thread::hardware_concurrency()) : 0;
+
     fprintf(stderr, ">>> ");
     getNextToken();
-    TheJit = ExitOnErr(JIT::Create());
+    if (AheadOfTime) {
+        ExitOnErr(InitializeAOT(TargetCPU, TargetFeatures));
+    } else {
+        // The executor reads readd() input itself: its arguments are the input file, if any
+        std::vector<std::string> Executor;
+        if (ExecutorProgram.getNumOccurrences() > 0) {
+            if (EvaluationThreads > 0 or ArgumentSpecialization) {
+                fprintf(stderr, "Error: --eval-threads and --specialize need the code in this process\n");
+                return 1;
+            }
+            Executor.push_back(ExecutorProgram.empty() ? KALEIDOSCOPE_EXECUTOR : ExecutorProgram.getValue());
+            if (InputFile.empty() == false) {
+                Executor.push_back(InputFile);
+            }
+        }
+        TheJit = ExitOnErr(JIT::Create(TargetCPU, TargetFeatures, CompileThreads, Executor));
+        ExitOnErr(TheJit->defineRuntimeSymbols(Runtime::getSymbols()));
+        if (EvaluationLimits.enabled() and TheJit->isRemote() == false) {
+            TheJit->enableSafepoints(reinterpret_cast<uintptr_t>(&kal_stack_limit),
+                                     reinterpret_cast<uintptr_t>(&kal_stack_span));
+            // Ctrl-C cancels the running expression, and still ends the session at the prompt
+            signal(SIGINT, [](int) {
+                if (Runtime::cancelEvaluation() == false) {
+                    signal(SIGINT, SIG_DFL);
+                    raise(SIGINT);
+                }
+            });
+        }
+    }
     InitializeModuleAndManagers();
-    MainLoop();
+    for (auto &File: IRFiles) {
+        ExitOnErr(LoadIR(File));
+    }
+    if (SnapshotFile.empty() == false) {
+        ExitOnErr(LoadSnapshot(SnapshotFile));
+    }
+    MainLoop(ParseAhead);
+    Runtime::flushOutput();
+
+    if (AheadOfTime) {
+        AddPointerEntryPoints(*TheModule);
+        if (Multiversion) {
+            MultiversionFunctions(*TheModule);
+        }
+        OptimizeModule(DefinitionOptimizationLevel);
+        if (HeaderFile.empty() == false) {
+            ExitOnErr(EmitHeader(*TheModule, HeaderFile));
+        }
+        if (OutputFile.empty() == false) {
+            ExitOnErr(EmitObject(*TheModule, OutputFile, LinkerProgram, RuntimeLibrary));
+        }
+    }
     return 0;
 }
@@ -2,12 +2,29 @@
 #include "lexer.h"
 #include "parser.h"
 #include "codegen.h"
+#include "library.h"
+#include "aot.h"
+#include "snapshot.h"
+#include "profile.h"
+#include "irimport.h"
+#include "specialize.h"
+#include "purity.h"
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdio>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <thread>
 #include <map>
 #include <vector>
 #include <string>
 #include <cctype>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/Support/DynamicLibrary.h>
 #include <llvm/Support/raw_ostream.h>
 
 #include "codegen.h"
@@ -27,11 +44,6 @@ int getNextToken() {
     return CurrentToken = gettok();
 };
 
-std::unique_ptr<ExpressionASTNode> LogError(const char *str) {
-    fprintf(stderr, "Error: %s\n", str);
-    return nullptr;
-}
-
 std::unique_ptr<SignatureASTNode> LogErrorS(const char *str) {
     LogError(str);
     return nullptr;
@@ -250,38 +262,104 @@ static std::unique_ptr<ExpressionASTNode> ParseBinaryOperatorRHS
     }
 }
 
+static std::unique_ptr<SignatureASTNode> ParseSignatureArguments(const std::string &FunctionName);
+
 static std::unique_ptr<SignatureASTNode> ParseSignature() {
     if (CurrentToken != tok_identifier) {
         return LogErrorS("Expected function name in signature");
     }
     std::string FunctionName = IdentifierStr;
     getNextToken();
+    return ParseSignatureArguments(FunctionName);
+}
+
+// Optional `:vec2`, `:vec4` or `:vec8` after an argument or the signature; 0 for a number
+static bool ParseTypeAnnotation(unsigned int &Lanes) {
+    Lanes = 0;
+    if (CurrentToken != ':') {
+        return true;
+    }
+    getNextToken();
+    if (CurrentToken == tok_identifier) {
+        for (unsigned int N: {2, 4, 8}) {
+            if (IdentifierStr == "vec" + std::to_string(N)) {
+                Lanes = N;
+                getNextToken();
+                return true;
+            }
+        }
+    }
+    LogError("Expected vec2, vec4 or vec8 after ':'");
+    return false;
+}
 
+static std::unique_ptr<SignatureASTNode> ParseSignatureArguments(const std::string &FunctionName) {
     if (CurrentToken != '(') {
         return LogErrorS("Expected '(' in signature");
     }
 
     std::vector<std::string> ArgumentNames;
-    while (getNextToken() == tok_identifier) {
+    std::vector<unsigned int> ArgumentLanes;
+    getNextToken();
+    while (CurrentToken == tok_identifier) {
         ArgumentNames.push_back(IdentifierStr);
+        getNextToken();
+        ArgumentLanes.emplace_back();
+        if (ParseTypeAnnotation(ArgumentLanes.back()) == false) {
+            return nullptr;
+        }
     }
 
     if (CurrentToken != ')') {
         return LogErrorS("Expected ')' in signature");
     }
     getNextToken();
-    return std::make_unique<SignatureASTNode>(FunctionName, std::move(ArgumentNames));
+    unsigned int ReturnLanes;
+    if (ParseTypeAnnotation(ReturnLanes) == false) {
+        return nullptr;
+    }
+    return std::make_unique<SignatureASTNode>(FunctionName, std::move(ArgumentNames), std::move(ArgumentLanes),
+                                              ReturnLanes);
+}
+
+// Apply a definition qualifier, false if Word is not one
+static bool ParseQualifier(const std::string &Word, FunctionQualifiers &Qualifiers) {
+    if (Word == "strict") {
+        Qualifiers.FPMode = FloatingPointMode::Strict;
+    } else if (Word == "contract") {
+        Qualifiers.FPMode = FloatingPointMode::Contract;
+    } else if (Word == "fast") {
+        Qualifiers.FPMode = FloatingPointMode::Fast;
+    } else if (Word == "memo") {
+        Qualifiers.Memoize = true;
+    } else {
+        return false;
+    }
+    return true;
 }
 
 static std::unique_ptr<FunctionASTNode> ParseDefinition() {
     getNextToken();
-    auto Signature = ParseSignature();
-    if (!Signature) {
+
+    // Qualifiers come before the name; a qualifier word followed by '(' is the name itself
+    FunctionQualifiers Qualifiers;
+    while (CurrentToken == tok_identifier) {
+        std::string Word = IdentifierStr;
+        getNextToken();
+        if (CurrentToken != '(' and ParseQualifier(Word, Qualifiers)) {
+            continue;
+        }
+
+        auto Signature = ParseSignatureArguments(Word);
+        if (!Signature) {
+            return nullptr;
+        }
+        if (auto E = ParseExpression()) {
+            return std::make_unique<FunctionASTNode>(std::move(Signature), std::move(E), Qualifiers);
+        }
         return nullptr;
     }
-    if (auto E = ParseExpression()) {
-        return std::make_unique<FunctionASTNode>(std::move(Signature), std::move(E));
-    }
+    LogErrorS("Expected function name in signature");
     return nullptr;
 }
 
@@ -290,90 +368,786 @@ static std::unique_ptr<SignatureASTNode> ParseExtern() {
     return ParseSignature();
 }
 
+static std::unique_ptr<FunctionASTNode> MakeTopLevelFunction(std::unique_ptr<ExpressionASTNode> E) {
+    auto Signature = std::make_unique<SignatureASTNode>("__anon_expr", std::vector<std::string>());
+    FunctionQualifiers Qualifiers;
+    Qualifiers.TopLevel = true;
+    return std::make_unique<FunctionASTNode>(std::move(Signature), std::move(E), Qualifiers);
+}
+
 static std::unique_ptr<FunctionASTNode> ParseTopLevelExpression() {
     if (auto E = ParseExpression()) {
-        auto Signature = std::make_unique<SignatureASTNode>("__anon_expr", std::vector<std::string>());
-        return std::make_unique<FunctionASTNode>(std::move(Signature), std::move(E));
+        return MakeTopLevelFunction(std::move(E));
+    }
+    return nullptr;
+}
+
+// A statement read by ParseStatement and run by RunStatement. The parser can run ahead of
+// code generation on its own thread (MainLoop(true)), so nothing here depends on compiled code.
+struct Statement {
+    enum class StatementKind {
+        Empty, // ';' or a statement with a syntax error
+        Definition,
+        Extern,
+        Expression,
+        Command, // :save, :load, :load-ir, :specializations, :target, :memory, :restart
+        Measure, // :bench, :profile
+        End, // end of input
+    } Kind = StatementKind::Empty;
+
+    std::unique_ptr<FunctionASTNode> Function; // Definition, Expression, Measure
+    std::unique_ptr<SignatureASTNode> Signature; // Extern
+    std::string Command, Argument; // Command, Measure
+    double Calls = 0; // Measure: 0 to run for about a second
+    std::string Errors; // Syntax errors found on the parser thread, printed when the statement runs
+};
+
+// Errors of the parser thread go into its current statement, so they stay in program order
+static thread_local std::string *ErrorOutput = nullptr;
+
+std::unique_ptr<ExpressionASTNode> LogError(const char *str) {
+    if (ErrorOutput != nullptr) {
+        *ErrorOutput += std::string("Error: ") + str + "\n";
+    } else {
+        fprintf(stderr, "Error: %s\n", str);
     }
     return nullptr;
 }
 
+// A command takes the rest of its line, but the token after it is only read before the next statement:
+// at an interactive prompt the command runs before the user types anything else
+static bool NeedsToken = false;
+
+// :bench [calls] expression, :profile [calls] expression
+static void ParseMeasureCommand(Statement &S) {
+    getNextToken(); // eat the command
+
+    // A leading number is the count when an expression follows it, else it starts the expression
+    std::unique_ptr<ExpressionASTNode> E;
+    if (CurrentToken == tok_number) {
+        double Number = NumVal;
+        getNextToken();
+        if (CurrentToken == tok_identifier or CurrentToken == tok_number or CurrentToken == '(' or
+            CurrentToken == tok_if or CurrentToken == tok_for) {
+            S.Calls = Number;
+        } else {
+            E = ParseBinaryOperatorRHS(0, std::make_unique<NumberExpressionASTNode>(Number));
+        }
+    }
+    if (E == nullptr) {
+        E = ParseExpression();
+    }
+    if (E == nullptr) {
+        getNextToken();
+        return;
+    }
+    S.Kind = Statement::StatementKind::Measure;
+    S.Function = MakeTopLevelFunction(std::move(E));
+}
+
 // Top Level parsing
-static void HandleDefinition() {
-    auto FunctionAST = ParseDefinition();
-    if (FunctionAST != nullptr) {
-        auto *FunctionIR = FunctionAST->codegen();
-        fprintf(stderr, "Parsed a function definition.\n");
-        FunctionIR->print(llvm::errs());
-        ExitOnErr(TheJit->addModule(
-            llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext))
+static Statement ParseStatement() {
+    if (NeedsToken) {
+        NeedsToken = false;
+        getNextToken();
+    }
+
+    Statement S;
+    switch (CurrentToken) {
+        case tok_eof:
+            S.Kind = Statement::StatementKind::End;
+            break;
+        case ';':
+            getNextToken();
+            break;
+        case tok_def:
+            S.Function = ParseDefinition();
+            if (S.Function != nullptr) {
+                S.Kind = Statement::StatementKind::Definition;
+            } else {
+                getNextToken();
+            }
+            break;
+        case tok_extern:
+            S.Signature = ParseExtern();
+            if (S.Signature != nullptr) {
+                S.Kind = Statement::StatementKind::Extern;
+            } else {
+                getNextToken();
+            }
+            break;
+        case tok_command:
+            S.Command = IdentifierStr;
+            if (S.Command == "bench" or S.Command == "profile") {
+                ParseMeasureCommand(S);
+            } else {
+                S.Kind = Statement::StatementKind::Command;
+                S.Argument = getCommandArgument();
+                NeedsToken = true;
+            }
+            break;
+        default:
+            S.Function = ParseTopLevelExpression();
+            if (S.Function != nullptr) {
+                S.Kind = Statement::StatementKind::Expression;
+            } else {
+                getNextToken();
+            }
+            break;
+    }
+    return S;
+}
+
+// Every function a definition calls must exist before its module is compiled: an extern of a
+// function that is only defined later would fail to link and poison the definition
+static bool canCompileAhead(const llvm::Module &M) {
+    for (const llvm::Function &F: M) {
+        if (F.isDeclaration() == false or F.isIntrinsic() or Definitions.count(F.getName().str()) != 0 or
+            isImportedFunction(F.getName())) {
+            continue;
+        }
+        bool IsRuntime = false;
+        for (auto &Symbol: Runtime::getSymbols()) {
+            IsRuntime = IsRuntime or F.getName() == Symbol.first;
+        }
+        if (IsRuntime == false and llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(F.getName().str()) == nullptr) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Purity inference and the optimizer leave only memory(none) or, for vector results, memory(argmem: write) on
+// expressions without I/O. Calls to memo functions add inaccessible memory: their caches, which are thread-safe.
+static bool IsParallelizable(const llvm::Function &F) {
+    if (F.onlyAccessesArgMemory()) {
+        return true;
+    }
+    if (F.onlyAccessesInaccessibleMemOrArgMem() == false) {
+        return false;
+    }
+    for (const llvm::Instruction &I: llvm::instructions(F)) {
+        auto *Call = llvm::dyn_cast<llvm::CallBase>(&I);
+        if (Call == nullptr or Call->onlyAccessesArgMemory()) {
+            continue;
+        }
+        if (Call->getCalledFunction() == nullptr or IsPure(*Call->getCalledFunction()) == false) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Functions calling a redefined function keep their code, compiled against its old signature and purity.
+// nullptr if the new definition can take its place.
+static const char *checkRedefinition(const SignatureASTNode &Old, const SignatureASTNode &New) {
+    if (Old.getArguments().size() != New.getArguments().size() or
+        Old.getArgumentLanes() != New.getArgumentLanes() or Old.getReturnLanes() != New.getReturnLanes()) {
+        return "Redefinition must keep the number and types of the arguments and the result";
+    }
+    if (Old.isPure() and New.isPure() == false) {
+        return "Redefinition must stay pure: its callers were optimized assuming it is";
+    }
+    if (Old.alwaysReturns() and New.alwaysReturns() == false) {
+        return "Redefinition must still always return (no loops or recursion): its callers were optimized assuming it does";
+    }
+    if (Old.isPure() and Old.hasHiddenState() == false and New.hasHiddenState()) {
+        return "Redefinition must not fill a memo cache: its callers were optimized assuming it touches no memory";
+    }
+    return nullptr;
+}
+
+static void RunDefinition(FunctionASTNode &FunctionAST) {
+    // The previous signature stays in use until the new definition is known to be compatible
+    std::string Name = FunctionAST.getName();
+    if (isImportedFunction(Name)) {
+        LogError("Cannot redefine a function loaded from LLVM IR");
+        return;
+    }
+    std::unique_ptr<SignatureASTNode> Previous;
+    if (isAOT() == false and TheJit->isDefined(Name) and Signatures.count(Name) != 0) {
+        Previous = std::move(Signatures[Name]);
+    }
+
+    auto *FunctionIR = FunctionAST.codegen();
+    if (FunctionIR == nullptr) {
+        if (Previous != nullptr) {
+            Signatures[Name] = std::move(Previous);
+        }
+        return;
+    }
+    if (Previous != nullptr) {
+        if (const char *Problem = checkRedefinition(*Previous, *Signatures[Name])) {
+            LogError(Problem);
+            Signatures[Name] = std::move(Previous);
+            InitializeModuleAndManagers(); // drop the new module
+            return;
+        }
+    }
+
+    // AOT mode keeps every definition in TheModule until EOF and optimizes it once
+    if (isAOT() == false) {
+        OptimizeModule(DefinitionOptimizationLevel);
+    }
+    fprintf(stderr, "Parsed a function definition.\n");
+    FunctionIR->print(llvm::errs());
+    if (isAOT() == false) {
+        RecordDefinition(Name, *TheModule);
+        bool CompileAhead = TheJit->compilesConcurrently() and canCompileAhead(*TheModule);
+        std::string Implementation = ExitOnErr(TheJit->addDefinition(
+            Name, llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext))
         ));
         InitializeModuleAndManagers();
-    } else {
-        getNextToken();
+        if (CompileAhead) {
+            TheJit->compileInBackground({Implementation});
+        }
+        if (ArgumentSpecialization) {
+            StartArgumentProfile(Name);
+        }
+        if (Previous != nullptr) {
+            fprintf(stderr, "Redefined %s\n", Name.c_str());
+        }
     }
 }
 
-static void HandleExtern() {
-    auto SignatureAST = ParseExtern();
-    if (SignatureAST != nullptr) {
-        auto *FunctionIR = SignatureAST->codegen();
-        if (FunctionIR != nullptr) {
-            fprintf(stderr, "Parsed an extern\n");
-            FunctionIR->print(llvm::errs());
-            Signatures[SignatureAST->getName()] = std::move(SignatureAST);
+static void RunExtern(std::unique_ptr<SignatureASTNode> SignatureAST) {
+    // The signature read from the IR stays, with its purity
+    auto Existing = Signatures.find(SignatureAST->getName());
+    if (Existing != Signatures.end() and isImportedFunction(Existing->first)) {
+        if (Existing->second->getArgumentLanes() != SignatureAST->getArgumentLanes() or
+            Existing->second->getReturnLanes() != SignatureAST->getReturnLanes()) {
+            LogError("extern does not match the function loaded from LLVM IR");
         }
+        return;
+    }
+    auto *FunctionIR = SignatureAST->codegen();
+    if (FunctionIR != nullptr) {
+        fprintf(stderr, "Parsed an extern\n");
+        FunctionIR->print(llvm::errs());
+        SignatureAST->setExtern();
+        Signatures[SignatureAST->getName()] = std::move(SignatureAST);
+    }
+}
+
+// A top-level expression added to the JIT; TheJit->removeModule(Tracker) frees it again
+struct CompiledExpression {
+    llvm::orc::ResourceTrackerSP Tracker;
+    llvm::orc::ExecutorAddr Address;
+    unsigned int Lanes; // 0 for a number, else the result is stored through a double * argument
+};
+
+// Add TheModule, which holds an optimized top-level expression, to the JIT and start a new module
+static llvm::orc::ResourceTrackerSP AddTopLevelExpression() {
+    auto resource_tracker = TheJit->getMainJITDylib().createResourceTracker();
+    auto thread_safe_module = llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
+
+    ExitOnErr(TheJit->addModule(std::move(thread_safe_module), resource_tracker));
+
+    InitializeModuleAndManagers();
+    return resource_tracker;
+}
+
+static unsigned int NextExpression = 0;
+
+// Name the top-level expression FunctionIR, __anon_expr, after its own number in the JIT: several can be
+// there at once (--eval-threads, or the code of an abandoned evaluation kept until it has left)
+static std::string NameTopLevelExpression(llvm::Function *FunctionIR) {
+    std::string Name = "__anon_expr." + std::to_string(NextExpression++);
+    FunctionIR->setName(Name);
+    return Name;
+}
+
+static CompiledExpression LookupTopLevelExpression(llvm::orc::ResourceTrackerSP Tracker, const std::string &Name) {
+    auto ExprSymbol = ExitOnErr(TheJit->lookup(Name));
+    return CompiledExpression{Tracker, ExprSymbol.getAddress(), Signatures["__anon_expr"]->getReturnLanes()};
+}
+
+static std::optional<CompiledExpression> CompileTopLevelExpression(FunctionASTNode &FunctionAST, bool PrintIR) {
+    auto *FunctionIR = FunctionAST.codegen();
+    if (FunctionIR == nullptr) {
+        return std::nullopt;
+    }
+    OptimizeModule(ExpressionOptimizationLevel);
+
+    if (PrintIR) {
+        // print LLVM IR
+        fprintf(stderr, "Read top-level expression:\n");
+        FunctionIR->print(llvm::errs());
+    }
+
+    std::string Name = NameTopLevelExpression(FunctionIR);
+    return LookupTopLevelExpression(AddTopLevelExpression(), Name);
+}
+
+Runtime::EvaluationLimits EvaluationLimits;
+
+// The call of a compiled expression, which a limited evaluation may abandon: nothing to destroy
+struct ExpressionCall {
+    llvm::orc::ExecutorAddr Address;
+    unsigned int Lanes;
+    double Result[8];
+};
+
+static void CallExpression(void *Context) {
+    auto *Call = static_cast<ExpressionCall *>(Context);
+    if (Call->Lanes == 0) {
+        Call->Result[0] = Call->Address.toPtr<double (*)()>()();
     } else {
-        getNextToken();
+        // Vector results come back through memory
+        Call->Address.toPtr<double (*)(double *)>()(Call->Result);
+    }
+}
+
+static const char *DescribeCancellation(Runtime::EvaluationStatus Status) {
+    switch (Status) {
+        case Runtime::EvaluationStatus::TimedOut:
+            return "it took longer than --timeout";
+        case Runtime::EvaluationStatus::Interrupted:
+            return "interrupted";
+        case Runtime::EvaluationStatus::StackExhausted:
+            return "it ran out of stack (--eval-stack)";
+        case Runtime::EvaluationStatus::MemoLimitReached:
+            return "its memo caches grew beyond --eval-memory";
+        case Runtime::EvaluationStatus::Abandoned:
+            return "it is still in a runtime or library call and was abandoned";
+        default:
+            return "finished";
+    }
+}
+
+// Call a compiled expression, print its result and free it. With limits, it runs on a thread of its own
+// and is cancelled at a safepoint when it reaches one; the session goes on as if it had returned.
+static void EvaluateTopLevelExpression(const CompiledExpression &Expression) {
+    // Code replaced since an evaluation was abandoned is freed once it has left
+    if (Runtime::hasAbandonedEvaluation() == false) {
+        ExitOnErr(TheJit->releaseRetainedCode());
+    }
+
+    auto Call = std::make_unique<ExpressionCall>(ExpressionCall{Expression.Address, Expression.Lanes, {}});
+    auto Status = Runtime::EvaluationStatus::Finished;
+    if (EvaluationLimits.enabled()) {
+        Status = Runtime::evaluateWithLimits(CallExpression, Call.get(), EvaluationLimits);
+    } else {
+        CallExpression(Call.get());
+    }
+    Runtime::flushOutput(); // keep runtime output ahead of the result and the next prompt
+
+    if (Status == Runtime::EvaluationStatus::Abandoned) {
+        // Still runs: its result goes to Call, and no code it may reach is freed until it has left
+        Call.release();
+        TheJit->retainRemovedCode();
+    }
+    if (Status != Runtime::EvaluationStatus::Finished) {
+        fprintf(stderr, "Error: evaluation cancelled: %s\n", DescribeCancellation(Status));
+    } else {
+        kal_print_result(Call->Result, Expression.Lanes);
+    }
+
+    ExitOnErr(TheJit->removeModule(Expression.Tracker));
+}
+
+unsigned int EvaluationThreads = 0;
+
+// Expressions being evaluated on other threads, oldest first. Everything the main thread prints
+// after one of them (its result, the next prompt, ...) is held back until it has finished.
+struct PendingEvaluation {
+    std::string Output; // IR, printed before the result like on the main thread
+    std::future<std::string> Result;
+    llvm::orc::ResourceTrackerSP Tracker;
+    std::string Prompt;
+};
+
+static std::deque<PendingEvaluation> PendingEvaluations;
+
+// Runs on a worker thread: compile and call the expression Name, and format its result like
+// EvaluateTopLevelExpression prints it
+static std::string EvaluateOnWorker(const std::string &Name, unsigned int Lanes) {
+    auto ExprSymbol = TheJit->lookupUncached(Name);
+    if (!ExprSymbol) {
+        return "Error: " + llvm::toString(ExprSymbol.takeError()) + "\n";
+    }
+
+    ExpressionCall Call{ExprSymbol->getAddress(), Lanes, {}};
+    CallExpression(&Call);
+    return Runtime::formatResult(Call.Result, Lanes);
+}
+
+static void FinishOldestEvaluation() {
+    PendingEvaluation &Evaluation = PendingEvaluations.front();
+    std::string Result = Evaluation.Result.get();
+    fputs(Evaluation.Output.c_str(), stderr);
+    fputs(Result.c_str(), stderr);
+    fputs(Evaluation.Prompt.c_str(), stderr);
+    ExitOnErr(TheJit->removeModule(Evaluation.Tracker));
+    PendingEvaluations.pop_front();
+}
+
+// Wait for every pending evaluation and print what was held back
+static void FinishEvaluations() {
+    while (PendingEvaluations.empty() == false) {
+        FinishOldestEvaluation();
+    }
+}
+
+static void PrintPrompt() {
+    if (PendingEvaluations.empty()) {
+        fprintf(stderr, ">>> ");
+    } else {
+        PendingEvaluations.back().Prompt += ">>> ";
+    }
+}
+
+// With --eval-threads, an expression that does no I/O is compiled and called on a thread of its own
+// while the next statements are compiled. Anything else waits for the pending evaluations first.
+static void StartTopLevelExpression(FunctionASTNode &FunctionAST) {
+    // Errors and IR can only be printed once the evaluations before this one have printed their results
+    std::string Output;
+    ErrorOutput = &Output;
+    auto *FunctionIR = FunctionAST.codegen();
+    ErrorOutput = nullptr;
+    if (FunctionIR == nullptr) {
+        FinishEvaluations();
+        fputs(Output.c_str(), stderr);
+        return;
+    }
+    OptimizeModule(ExpressionOptimizationLevel);
+
+    llvm::raw_string_ostream IR(Output);
+    IR << "Read top-level expression:\n" << *FunctionIR;
+    IR.flush();
+
+    if (IsParallelizable(*FunctionIR) == false) {
+        FinishEvaluations();
+        fputs(Output.c_str(), stderr);
+        std::string Name = NameTopLevelExpression(FunctionIR);
+        EvaluateTopLevelExpression(LookupTopLevelExpression(AddTopLevelExpression(), Name));
+        return;
+    }
+
+    std::string Name = NameTopLevelExpression(FunctionIR);
+    unsigned int Lanes = Signatures["__anon_expr"]->getReturnLanes();
+    auto Tracker = AddTopLevelExpression();
+
+    if (PendingEvaluations.size() >= EvaluationThreads) {
+        FinishOldestEvaluation();
+    }
+    PendingEvaluations.push_back({std::move(Output),
+                                  std::async(std::launch::async, EvaluateOnWorker, Name, Lanes),
+                                  std::move(Tracker), ""});
+}
+
+// Start a new executor process with every definition and IR file of the session, after the last one died
+// or for :restart. The definitions are compiled again from their optimized bitcode on their first call.
+static void RestartExecutor() {
+    TheJit = ExitOnErr(TheJit->recreate());
+    ExitOnErr(TheJit->defineRuntimeSymbols(Runtime::getSymbols()));
+    InitializeModuleAndManagers();
+    ExitOnErr(RestoreImportedModules());
+    ExitOnErr(RestoreDefinitions());
+    fprintf(stderr, "Restarted the executor process\n");
+}
+
+// In an executor process, a main around the expression prints the result there. A crash ends the
+// executor instead of the session.
+static void RunRemoteTopLevelExpression(FunctionASTNode &FunctionAST) {
+    auto *FunctionIR = FunctionAST.codegen();
+    if (FunctionIR == nullptr) {
+        return;
     }
+    std::string Main = codegenExpressionMain(FunctionIR, Signatures["__anon_expr"]->getReturnLanes())
+        ->getName().str();
+    OptimizeModule(ExpressionOptimizationLevel);
+
+    // print LLVM IR
+    fprintf(stderr, "Read top-level expression:\n");
+    FunctionIR->print(llvm::errs());
+
+    auto Tracker = AddTopLevelExpression();
+
+    // The executor cannot be interrupted in the middle of an expression: --timeout ends it
+    std::mutex WatchdogMutex;
+    std::condition_variable Finished;
+    bool Done = false, TimedOut = false;
+    std::thread Watchdog;
+    if (EvaluationLimits.Timeout > 0) {
+        Watchdog = std::thread([&] {
+            std::unique_lock<std::mutex> Lock(WatchdogMutex);
+            if (Finished.wait_for(Lock, std::chrono::duration<double>(EvaluationLimits.Timeout),
+                                  [&Done] { return Done; }) == false) {
+                TimedOut = true;
+                TheJit->killExecutor();
+            }
+        });
+    }
+    auto Status = TheJit->runAsMain(Main);
+    if (Watchdog.joinable()) {
+        {
+            std::lock_guard<std::mutex> Lock(WatchdogMutex);
+            Done = true;
+        }
+        Finished.notify_one();
+        Watchdog.join();
+    }
+
+    if (TimedOut) {
+        llvm::consumeError(Status.takeError());
+        fprintf(stderr, "Error: evaluation cancelled: %s\n",
+                DescribeCancellation(Runtime::EvaluationStatus::TimedOut));
+        RestartExecutor();
+        return;
+    }
+    if (!Status) {
+        fprintf(stderr, "Error: %s\n", llvm::toString(Status.takeError()).c_str());
+        RestartExecutor();
+        return;
+    }
+    ExitOnErr(TheJit->removeModule(Tracker));
 }
 
-static void HandleTopLevelExpression() {
-    auto FunctionAST = ParseTopLevelExpression();
-    if (FunctionAST != nullptr) {
-        auto *FunctionIR = FunctionAST->codegen();
-        if (FunctionIR != nullptr) {
-            // print LLVM IR
-            fprintf(stderr, "Read top-level expression:\n");
-            FunctionIR->print(llvm::errs());
+static void RunTopLevelExpression(FunctionASTNode &FunctionAST) {
+    if (isAOT()) {
+        fprintf(stderr, "Skipped top-level expression: nothing is evaluated in AOT mode\n");
+        return;
+    }
+    if (TheJit->isRemote()) {
+        RunRemoteTopLevelExpression(FunctionAST);
+    } else if (EvaluationThreads > 0) {
+        StartTopLevelExpression(FunctionAST);
+    } else if (auto Expression = CompileTopLevelExpression(FunctionAST, true)) {
+        EvaluateTopLevelExpression(*Expression);
+    }
+}
 
-            auto resource_tracker = TheJit->getMainJITDylib().createResourceTracker();
-            auto thread_safe_module = llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
+// :bench and :profile compile the expression once and call it repeatedly
+static void RunMeasureCommand(Statement &S) {
+    if (isAOT()) {
+        LogError("Nothing is evaluated in AOT mode");
+        return;
+    }
+    if (TheJit->isRemote()) {
+        LogError("Measurements need the code in this process, not an executor process");
+        return;
+    }
+    if (S.Calls < 0 or S.Calls != std::trunc(S.Calls)) {
+        LogError("Expected a whole number of calls");
+        return;
+    }
+    uint64_t Calls = static_cast<uint64_t>(S.Calls);
 
-            ExitOnErr(TheJit->addModule(std::move(thread_safe_module), resource_tracker));
+    auto Expression = CompileTopLevelExpression(*S.Function, false);
+    if (!Expression) {
+        return;
+    }
 
-            InitializeModuleAndManagers();
+    double Lanes[8];
+    double (*Scalar)() = Expression->Address.toPtr<double (*)()>();
+    double (*Vector)(double *) = Expression->Address.toPtr<double (*)(double *)>();
+    auto Run = [&] {
+        if (Expression->Lanes == 0) {
+            Scalar();
+        } else {
+            Vector(Lanes);
+        }
+    };
 
-            auto ExprSymbol = ExitOnErr(TheJit->lookup("__anon_expr"));
-            double (*FunctionPointer)() = ExprSymbol.toPtr<double (*)()>();
+    if (S.Command == "bench") {
+        BenchmarkResult Result = Benchmark(Run, Calls);
+        Runtime::flushOutput();
+        fprintf(stderr, "%llu calls in %llu batches, mean per call of a batch: min %s, median %s, p99 %s\n",
+                static_cast<unsigned long long>(Result.Calls), static_cast<unsigned long long>(Result.Samples),
+                FormatNanoseconds(Result.MinNanoseconds).c_str(), FormatNanoseconds(Result.MedianNanoseconds).c_str(),
+                FormatNanoseconds(Result.P99Nanoseconds).c_str());
+        if (Result.HasCounters) {
+            fprintf(stderr, "%.1f cycles, %.1f instructions per call (IPC %.2f)\n", Result.Cycles,
+                    Result.Instructions, Result.Cycles > 0 ? Result.Instructions / Result.Cycles : 0.0);
+        } else {
+            fprintf(stderr, "Cycle and instruction counts unavailable (perf_event_open failed)\n");
+        }
+    } else {
+        std::vector<ProfileEntry> Entries;
+        bool Supported = Profile(Run, Calls, [](uint64_t Address) { return TheJit->findFunction(Address); },
+                                 Entries);
+        Runtime::flushOutput();
+        if (Supported == false) {
+            LogError("Sampling is not supported on this platform");
+        } else {
+            uint64_t Total = 0;
+            for (auto &Entry: Entries) {
+                Total += Entry.Samples;
+            }
+            fprintf(stderr, "%llu samples\n", static_cast<unsigned long long>(Total));
+            for (auto &Entry: Entries) {
+                fprintf(stderr, "%6.1f%%  %s\n", 100.0 * Entry.Samples / Total,
+                        Entry.Function.empty() ? "(outside JIT code)" : Entry.Function.c_str());
+            }
+        }
+    }
 
-            fprintf(stderr, "Evaluated to %f\n", FunctionPointer());
+    ExitOnErr(TheJit->removeModule(Expression->Tracker));
+}
 
-            ExitOnErr(resource_tracker->remove());
+// REPL commands
+static void RunCommand(const std::string &Command, const std::string &Argument) {
+    if (Command == "save" or Command == "load") {
+        if (isAOT()) {
+            LogError("Snapshots are not available in AOT mode");
+        } else if (Argument.empty()) {
+            LogError("Expected a snapshot file name");
+        } else if (auto Error = Command == "save" ? SaveSnapshot(Argument) : LoadSnapshot(Argument)) {
+            fprintf(stderr, "Error: %s\n", llvm::toString(std::move(Error)).c_str());
+        } else {
+            fprintf(stderr, Command == "save" ? "Saved snapshot %s\n" : "Loaded snapshot %s\n", Argument.c_str());
+        }
+    } else if (Command == "load-ir") {
+        if (Argument.empty()) {
+            LogError("Expected a .ll or .bc file name");
+        } else if (auto Names = LoadIR(Argument)) {
+            std::string List;
+            for (auto &Name: *Names) {
+                List += (List.empty() ? "" : ", ") + Name;
+            }
+            fprintf(stderr, "Loaded %s: %s\n", Argument.c_str(), List.c_str());
+        } else {
+            fprintf(stderr, "Error: %s\n", llvm::toString(Names.takeError()).c_str());
+        }
+    } else if (Command == "specializations") {
+        PrintSpecializations();
+    } else if (Command == "target") {
+        // Only the enabled features; the host's list also spells out every missing one
+        llvm::TargetMachine *TM = getTargetMachine();
+        llvm::SmallVector<llvm::StringRef, 64> AllFeatures;
+        TM->getTargetFeatureString().split(AllFeatures, ',');
+        std::string Features;
+        for (llvm::StringRef Feature: AllFeatures) {
+            if (Feature.starts_with("+")) {
+                Features += (Features.empty() ? "" : " ") + Feature.drop_front().str();
+            }
+        }
+        fprintf(stderr, "Triple: %s\nCPU: %s\nFeatures: %s\n", TM->getTargetTriple().str().c_str(),
+                TM->getTargetCPU().str().c_str(), Features.c_str());
+    } else if (Command == "memory") {
+        if (isAOT()) {
+            LogError("Nothing is compiled in AOT mode");
+            return;
+        }
+        if (TheJit->isRemote()) {
+            LogError("Memory is only tracked for code in this process, not an executor process");
+            return;
         }
+        uint64_t Code = 0, Data = 0;
+        for (auto &[Name, Usage]: TheJit->getMemoryUsage()) {
+            if (Usage.Compiled) {
+                fprintf(stderr, "%-20s %8llu bytes code %8llu bytes data\n", Name.c_str(),
+                        static_cast<unsigned long long>(Usage.Code), static_cast<unsigned long long>(Usage.Data));
+                Code += Usage.Code;
+                Data += Usage.Data;
+            } else {
+                fprintf(stderr, "%-20s not compiled yet\n", Name.c_str());
+            }
+        }
+        fprintf(stderr, "%-20s %8llu bytes code %8llu bytes data\n", "total",
+                static_cast<unsigned long long>(Code), static_cast<unsigned long long>(Data));
+    } else if (Command == "restart") {
+        if (isAOT() or TheJit->isRemote() == false) {
+            LogError("Only an executor process (--executor) can be restarted");
+            return;
+        }
+        RestartExecutor();
     } else {
-        getNextToken();
+        LogError("Unknown command");
     }
 }
 
-void MainLoop() {
-    while (true) {
-        switch (CurrentToken) {
-            case tok_eof:
+// false at the end of input
+static bool RunStatement(Statement &S) {
+    // Only an expression can be compiled while earlier ones are still being evaluated
+    if (S.Kind != Statement::StatementKind::Expression or S.Errors.empty() == false) {
+        FinishEvaluations();
+    }
+    fputs(S.Errors.c_str(), stderr);
+    switch (S.Kind) {
+        case Statement::StatementKind::End:
+            return false;
+        case Statement::StatementKind::Empty:
+            break;
+        case Statement::StatementKind::Definition:
+            RunDefinition(*S.Function);
+            break;
+        case Statement::StatementKind::Extern:
+            RunExtern(std::move(S.Signature));
+            break;
+        case Statement::StatementKind::Expression:
+            RunTopLevelExpression(*S.Function);
+            break;
+        case Statement::StatementKind::Command:
+            RunCommand(S.Command, S.Argument);
+            break;
+        case Statement::StatementKind::Measure:
+            RunMeasureCommand(S);
+            break;
+    }
+    if (ArgumentSpecialization and isAOT() == false and PendingEvaluations.empty()) {
+        SpecializeStableArguments();
+    }
+    return true;
+}
+
+// Statements parsed ahead of the one being compiled, at most Capacity of them
+class StatementQueue {
+    static constexpr size_t Capacity = 64;
+    std::mutex Mutex;
+    std::condition_variable Changed;
+    std::deque<Statement> Statements;
+
+public:
+    void push(Statement S) {
+        std::unique_lock<std::mutex> Lock(Mutex);
+        Changed.wait(Lock, [this] { return Statements.size() < Capacity; });
+        Statements.push_back(std::move(S));
+        Changed.notify_all();
+    }
+
+    Statement pop() {
+        std::unique_lock<std::mutex> Lock(Mutex);
+        Changed.wait(Lock, [this] { return Statements.empty() == false; });
+        Statement S = std::move(Statements.front());
+        Statements.pop_front();
+        Changed.notify_all();
+        return S;
+    }
+};
+
+void MainLoop(bool ParseAhead) {
+    if (ParseAhead == false) {
+        while (true) {
+            Statement S = ParseStatement();
+            if (RunStatement(S) == false) {
                 return;
-            case ';':
-                getNextToken();
-                break;
-            case tok_def:
-                HandleDefinition();
-                break;
-            case tok_extern:
-                HandleExtern();
-                break;
-            default:
-                HandleTopLevelExpression();
-                break;
+            }
+            PrintPrompt();
         }
-        fprintf(stderr, ">>> ");
     }
+
+    // The parser thread owns the lexer and stdin from here on
+    StatementQueue Queue;
+    std::thread Parser([&Queue] {
+        bool End = false;
+        while (End == false) {
+            std::string Errors;
+            ErrorOutput = &Errors;
+            Statement S = ParseStatement();
+            ErrorOutput = nullptr;
+            S.Errors = std::move(Errors);
+            End = S.Kind == Statement::StatementKind::End;
+            Queue.push(std::move(S));
+        }
+    });
+    while (true) {
+        Statement S = Queue.pop();
+        if (RunStatement(S) == false) {
+            break;
+        }
+        PrintPrompt();
+    }
+    Parser.join();
 }
@@ -3,6 +3,8 @@
 
 #include <memory>
 
+#include "library.h"
+
 namespace ASTNode {
     class ExpressionASTNode;
     class SignatureASTNode;
@@ -14,7 +16,16 @@ std::unique_ptr<ASTNode::ExpressionASTNode> LogError(const char *str);
 
 std::unique_ptr<ASTNode::SignatureASTNode> LogErrorS(const char *str);
 
+// Read and run statements until the end of input. With ParseAhead the parser runs on its own
+// thread, up to a few dozen statements ahead; output stays in program order.
+void MainLoop(bool ParseAhead = false);
+
+// Top-level expressions without I/O evaluated at once on other threads (--eval-threads); 0 runs
+// every expression on the main thread
+extern unsigned int EvaluationThreads;
 
-void MainLoop();
+// --timeout, --eval-stack and --eval-memory for top-level expressions; in an executor process, only the
+// timeout applies, and it ends the executor
+extern Runtime::EvaluationLimits EvaluationLimits;
 
 #endif
@@ -0,0 +1,265 @@
+// :bench and :profile: timing, hardware counters and sampling of JIT-compiled code
+
+#include "profile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iterator>
+#include <map>
+
+#ifdef __linux__
+#include <csignal>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <ctime>
+#include <ucontext.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__aarch64__)
+#define KALEIDOSCOPE_SAMPLING 1
+#endif
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid // glibc before 2.35
+#endif
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr uint64_t MaxSamples = 1000; // Timed batches of a :bench run
+static constexpr double CalibrationNanoseconds = 1e7;
+
+static double nanosecondsSince(Clock::time_point Start) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - Start).count();
+}
+
+// Number of calls that run for about TargetNanoseconds. Doubles a batch until it takes 10 ms,
+// which also warms up caches and the branch predictor.
+static uint64_t calibrate(llvm::function_ref<void()> Run, double TargetNanoseconds = 1e9) {
+    for (uint64_t Batch = 1;; Batch *= 2) {
+        auto Start = Clock::now();
+        for (uint64_t i = 0; i < Batch; ++i) {
+            Run();
+        }
+        double Elapsed = nanosecondsSince(Start);
+        if (Elapsed >= CalibrationNanoseconds or Batch >= (uint64_t(1) << 40)) {
+            return std::max<uint64_t>(1, uint64_t(TargetNanoseconds / (Elapsed / Batch)));
+        }
+    }
+}
+
+static void warmup(llvm::function_ref<void()> Run, uint64_t Calls) {
+    for (uint64_t i = 0; i < std::min<uint64_t>(Calls / 10 + 1, 10000); ++i) {
+        Run();
+    }
+}
+
+// User-space cycles and retired instructions of this thread, read as one group
+class PerfCounters {
+    int Leader = -1, Instructions = -1;
+
+public:
+    PerfCounters() {
+#ifdef __linux__
+        Leader = open(PERF_COUNT_HW_CPU_CYCLES, -1);
+        if (Leader >= 0) {
+            Instructions = open(PERF_COUNT_HW_INSTRUCTIONS, Leader);
+        }
+#endif
+    }
+
+    ~PerfCounters() {
+#ifdef __linux__
+        if (Instructions >= 0) {
+            close(Instructions);
+        }
+        if (Leader >= 0) {
+            close(Leader);
+        }
+#endif
+    }
+
+    bool available() const {
+        return Leader >= 0 and Instructions >= 0;
+    }
+
+    void start() {
+#ifdef __linux__
+        if (available()) {
+            ioctl(Leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(Leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+#endif
+    }
+
+    // false if the counters could not be read
+    bool stop(uint64_t &CycleCount, uint64_t &InstructionCount) {
+#ifdef __linux__
+        if (available() == false) {
+            return false;
+        }
+        ioctl(Leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        struct {
+            uint64_t Count;
+            uint64_t Values[2];
+        } Group;
+        if (read(Leader, &Group, sizeof(Group)) != sizeof(Group) or Group.Count != 2) {
+            return false;
+        }
+        CycleCount = Group.Values[0];
+        InstructionCount = Group.Values[1];
+        return true;
+#else
+        return false;
+#endif
+    }
+
+private:
+#ifdef __linux__
+    static int open(uint64_t Event, int Group) {
+        perf_event_attr Attributes{};
+        Attributes.type = PERF_TYPE_HARDWARE;
+        Attributes.size = sizeof(Attributes);
+        Attributes.config = Event;
+        Attributes.disabled = Group < 0 ? 1 : 0;
+        Attributes.exclude_kernel = 1;
+        Attributes.exclude_hv = 1;
+        Attributes.read_format = PERF_FORMAT_GROUP;
+        return static_cast<int>(syscall(SYS_perf_event_open, &Attributes, 0, -1, Group, 0));
+    }
+#endif
+};
+
+BenchmarkResult Benchmark(llvm::function_ref<void()> Run, uint64_t Calls, double Seconds) {
+    if (Calls == 0) {
+        Calls = calibrate(Run, Seconds * 1e9);
+    } else {
+        warmup(Run, Calls);
+    }
+
+    // Timing every call would mostly measure the clock, so calls are timed in batches. The first
+    // Calls % Samples batches take one call more, so every requested call runs.
+    BenchmarkResult Result;
+    Result.Samples = std::min(Calls, MaxSamples);
+    Result.Calls = Calls;
+    uint64_t Batch = Calls / Result.Samples;
+    uint64_t Longer = Calls % Result.Samples;
+
+    std::vector<double> Times(Result.Samples);
+    PerfCounters Counters;
+    Counters.start();
+    for (uint64_t Sample = 0; Sample < Result.Samples; ++Sample) {
+        uint64_t BatchCalls = Batch + (Sample < Longer ? 1 : 0);
+        auto Start = Clock::now();
+        for (uint64_t i = 0; i < BatchCalls; ++i) {
+            Run();
+        }
+        Times[Sample] = nanosecondsSince(Start) / BatchCalls;
+    }
+    uint64_t Cycles, Instructions;
+    if (Counters.stop(Cycles, Instructions)) {
+        Result.HasCounters = true;
+        Result.Cycles = double(Cycles) / Result.Calls;
+        Result.Instructions = double(Instructions) / Result.Calls;
+    }
+
+    std::sort(Times.begin(), Times.end());
+    Result.MinNanoseconds = Times.front();
+    Result.MedianNanoseconds = Times[Times.size() / 2];
+    Result.P99Nanoseconds = Times[std::min(Times.size() - 1, Times.size() * 99 / 100)];
+    return Result;
+}
+
+std::string FormatNanoseconds(double Nanoseconds) {
+    static const char *const Units[] = {"ns", "us", "ms", "s"};
+    size_t Unit = 0;
+    while (Nanoseconds >= 1000 and Unit + 1 < std::size(Units)) {
+        Nanoseconds /= 1000;
+        ++Unit;
+    }
+    char Buffer[32];
+    snprintf(Buffer, sizeof(Buffer), "%.3g %s", Nanoseconds, Units[Unit]);
+    return Buffer;
+}
+
+#ifdef KALEIDOSCOPE_SAMPLING
+static constexpr size_t MaxProfileSamples = 1 << 20;
+static constexpr long SampleIntervalMicroseconds = 1000; // CPU-time timers tick at most every jiffy anyway
+
+static uint64_t *ProfileSamples;
+static std::atomic<size_t> ProfileSampleCount;
+
+// SIGPROF handler: only stores the interrupted program counter, which is async-signal-safe
+static void recordSample(int, siginfo_t *, void *Context) {
+    auto *UserContext = static_cast<ucontext_t *>(Context);
+#if defined(__x86_64__)
+    uint64_t Address = UserContext->uc_mcontext.gregs[REG_RIP];
+#else
+    uint64_t Address = UserContext->uc_mcontext.pc;
+#endif
+    size_t Index = ProfileSampleCount.fetch_add(1, std::memory_order_relaxed);
+    if (Index < MaxProfileSamples) {
+        ProfileSamples[Index] = Address;
+    }
+}
+#endif
+
+bool Profile(llvm::function_ref<void()> Run, uint64_t Calls,
+             llvm::function_ref<std::string(uint64_t)> Locate, std::vector<ProfileEntry> &Entries) {
+#ifdef KALEIDOSCOPE_SAMPLING
+    if (Calls == 0) {
+        Calls = calibrate(Run);
+    } else {
+        warmup(Run, Calls);
+    }
+
+    std::vector<uint64_t> Samples(MaxProfileSamples);
+    ProfileSamples = Samples.data();
+    ProfileSampleCount = 0;
+
+    struct sigaction Action{}, Previous{};
+    Action.sa_sigaction = recordSample;
+    Action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&Action.sa_mask);
+    sigaction(SIGPROF, &Action, &Previous);
+
+    // CPU time of this thread only: ITIMER_PROF would also sample the compile and evaluation threads
+    sigevent Event{};
+    Event.sigev_notify = SIGEV_THREAD_ID;
+    Event.sigev_signo = SIGPROF;
+    Event.sigev_notify_thread_id = static_cast<pid_t>(syscall(SYS_gettid));
+    timer_t Timer;
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &Event, &Timer) != 0) {
+        sigaction(SIGPROF, &Previous, nullptr);
+        return false;
+    }
+    itimerspec Interval{};
+    Interval.it_interval.tv_nsec = SampleIntervalMicroseconds * 1000;
+    Interval.it_value = Interval.it_interval;
+    timer_settime(Timer, 0, &Interval, nullptr);
+    for (uint64_t i = 0; i < Calls; ++i) {
+        Run();
+    }
+    timer_delete(Timer);
+    sigaction(SIGPROF, &Previous, nullptr);
+
+    std::map<std::string, uint64_t> Counts;
+    size_t Count = std::min(ProfileSampleCount.load(), MaxProfileSamples);
+    for (size_t i = 0; i < Count; ++i) {
+        ++Counts[Locate(Samples[i])];
+    }
+    ProfileSamples = nullptr;
+
+    Entries.clear();
+    for (auto &[Function, FunctionSamples]: Counts) {
+        Entries.push_back({Function, FunctionSamples});
+    }
+    std::stable_sort(Entries.begin(), Entries.end(), [](const ProfileEntry &A, const ProfileEntry &B) {
+        return A.Samples > B.Samples;
+    });
+    return true;
+#else
+    return false;
+#endif
+}
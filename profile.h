@@ -0,0 +1,38 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/STLExtras.h"
+
+// Timing of repeated calls, for :bench. Timing single calls would mostly measure the clock, so the statistics
+// are of the mean time per call of each batch, not of single calls.
+struct BenchmarkResult {
+    uint64_t Calls = 0;
+    uint64_t Samples = 0; // Calls are timed in this many batches, whose sizes differ by at most one
+    double MinNanoseconds = 0, MedianNanoseconds = 0, P99Nanoseconds = 0; // Of the batch means
+    bool HasCounters = false; // perf_event_open worked
+    double Cycles = 0, Instructions = 0; // Per call
+};
+
+// Time exactly Calls calls of Run after a warmup; Calls == 0 picks a count that runs for about Seconds
+BenchmarkResult Benchmark(llvm::function_ref<void()> Run, uint64_t Calls, double Seconds = 1);
+
+// "12.3 ns", "4.56 us", "7.89 ms" or "1.23 s"
+std::string FormatNanoseconds(double Nanoseconds);
+
+// Where the time of a :profile run went
+struct ProfileEntry {
+    std::string Function; // empty for code outside the JIT (runtime, libm, ...)
+    uint64_t Samples;
+};
+
+// Call Run like Benchmark does and sample the program counter; Locate maps an address to the
+// JIT-compiled function containing it. Entries are sorted by samples, most first.
+// false if sampling is not supported on this platform
+bool Profile(llvm::function_ref<void()> Run, uint64_t Calls,
+             llvm::function_ref<std::string(uint64_t)> Locate, std::vector<ProfileEntry> &Entries);
+
+#endif
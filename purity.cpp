@@ -0,0 +1,63 @@
+#include "purity.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+
+bool IsPure(const llvm::Function &F) {
+    return F.doesNotAccessMemory() or F.hasFnAttribute(PureAttribute);
+}
+
+void SetPure(llvm::Function &F, bool HiddenState, bool AlwaysReturns) {
+    if (HiddenState) {
+        F.setMemoryEffects(llvm::MemoryEffects::inaccessibleMemOnly());
+        F.addFnAttr(PureAttribute);
+    } else {
+        F.setDoesNotAccessMemory();
+    }
+    F.setDoesNotThrow();
+    if (AlwaysReturns) {
+        F.setWillReturn();
+    }
+}
+
+llvm::PreservedAnalyses PurityInferencePass::run(llvm::Function &F, llvm::FunctionAnalysisManager &FAM) {
+    if (IsPure(F)) {
+        return llvm::PreservedAnalyses::all();
+    }
+
+    bool HiddenState = Polled;
+    bool AlwaysReturns = FAM.getResult<llvm::LoopAnalysis>(F).empty();
+    for (llvm::Instruction &I: llvm::instructions(F)) {
+        auto *Call = llvm::dyn_cast<llvm::CallBase>(&I);
+        if (Call == nullptr) {
+            if (I.mayReadOrWriteMemory() or I.mayThrow()) {
+                return llvm::PreservedAnalyses::all();
+            }
+            continue;
+        }
+
+        // Recursion is optimistically pure: the other calls decide
+        llvm::Function *Callee = Call->getCalledFunction();
+        if (Callee == &F) {
+            AlwaysReturns = false;
+            continue;
+        }
+        if (Callee == nullptr or Call->doesNotThrow() == false) {
+            return llvm::PreservedAnalyses::all();
+        }
+        if (Call->doesNotAccessMemory() == false) {
+            if (Callee->hasFnAttribute(PureAttribute) == false) {
+                return llvm::PreservedAnalyses::all();
+            }
+            HiddenState = true;
+        }
+        AlwaysReturns = AlwaysReturns and Callee->willReturn();
+    }
+
+    SetPure(F, HiddenState, AlwaysReturns);
+
+    // Only attributes changed: the IR and its analyses are untouched
+    return llvm::PreservedAnalyses::all();
+}
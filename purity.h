@@ -0,0 +1,31 @@
+#ifndef PURITY_H
+#define PURITY_H
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/PassManager.h"
+
+// A pure function only computes on its arguments. LLVM sees it as memory(none), or, when it also writes state
+// no caller can observe (the polls of safepoints), as inaccessiblememonly with this attribute: its calls are
+// not CSE'd or hoisted then, but stay pure to the front end (memo, redefinition checks).
+constexpr const char *PureAttribute = "kaleidoscope-pure";
+
+bool IsPure(const llvm::Function &F);
+
+// Attributes of a pure function; HiddenState for inaccessiblememonly, and willreturn if AlwaysReturns
+void SetPure(llvm::Function &F, bool HiddenState, bool AlwaysReturns);
+
+// Marks a function pure and nounwind when it only computes on its arguments:
+// it touches no memory and only calls pure functions (or itself).
+// With Polled (safepoints are inserted after optimization), it has hidden state.
+// willreturn is only added when it has no loops and no recursion as well.
+class PurityInferencePass : public llvm::PassInfoMixin<PurityInferencePass> {
+    bool Polled;
+
+public:
+    explicit PurityInferencePass(bool Polled = false) : Polled(Polled) {
+    }
+
+    llvm::PreservedAnalyses run(llvm::Function &F, llvm::FunctionAnalysisManager &FAM);
+};
+
+#endif
@@ -0,0 +1,80 @@
+#include "safepoint.h"
+
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+// Monotonic: the word changes on another thread, and the poll must not be hoisted out of the loop
+static llvm::Value *loadWord(llvm::IRBuilder<> &Builder, uint64_t Address, const char *Name) {
+    // The module is compiled for this process only, so the address is a constant
+    llvm::Value *Pointer = Builder.CreateIntToPtr(Builder.getInt64(Address), Builder.getPtrTy());
+    llvm::LoadInst *Load = Builder.CreateAlignedLoad(Builder.getInt64Ty(), Pointer, llvm::Align(8), Name);
+    Load->setAtomic(llvm::AtomicOrdering::Monotonic);
+    return Load;
+}
+
+// Before Position: if Frame - *StackLimit > *StackSpan (unsigned, so also below the limit), call kal_safepoint
+static void insertPoll(llvm::Instruction *Position, llvm::Value *Frame, uint64_t StackLimit, uint64_t StackSpan) {
+    llvm::Module &M = *Position->getModule();
+    llvm::IRBuilder<> Builder(Position);
+    llvm::FunctionCallee Safepoint = M.getOrInsertFunction(
+        "kal_safepoint", llvm::FunctionType::get(Builder.getVoidTy(), false));
+    // It may leave the evaluation, which writes nothing generated code can see
+    auto *SafepointFunction = llvm::cast<llvm::Function>(Safepoint.getCallee());
+    SafepointFunction->setMemoryEffects(llvm::MemoryEffects::inaccessibleMemOnly());
+    SafepointFunction->setDoesNotThrow();
+
+    llvm::Value *Offset = Builder.CreateSub(Frame, loadWord(Builder, StackLimit, "limit"), "offset");
+    llvm::Value *Outside = Builder.CreateICmpUGT(Offset, loadWord(Builder, StackSpan, "span"), "safepoint");
+    llvm::Instruction *Then = llvm::SplitBlockAndInsertIfThen(
+        Outside, Position, false, llvm::MDBuilder(M.getContext()).createBranchWeights(1, 1 << 20));
+    llvm::IRBuilder<>(Then).CreateCall(Safepoint);
+}
+
+static void insertSafepoints(llvm::Function &F, uint64_t StackLimit, uint64_t StackSpan) {
+    // Collected first: inserting polls splits the blocks
+    llvm::DominatorTree DT(F);
+    llvm::LoopInfo LI(DT);
+    llvm::SmallSetVector<llvm::Instruction *, 8> BackEdges;
+    for (llvm::Loop *L: LI.getLoopsInPreorder()) {
+        llvm::SmallVector<llvm::BasicBlock *, 4> Latches;
+        L->getLoopLatches(Latches);
+        for (llvm::BasicBlock *Latch: Latches) {
+            BackEdges.insert(Latch->getTerminator());
+        }
+    }
+
+    // The stack grows down: one frame address per call, compared at the entry and on every back-edge
+    llvm::BasicBlock &Entry = F.getEntryBlock();
+    llvm::BasicBlock::iterator Position = Entry.getFirstInsertionPt();
+    while (llvm::isa<llvm::AllocaInst>(*Position)) {
+        ++Position;
+    }
+    llvm::IRBuilder<> Builder(&*Position);
+    llvm::Value *Frame = Builder.CreatePtrToInt(
+        Builder.CreateIntrinsic(llvm::Intrinsic::frameaddress, {Builder.getPtrTy()}, {Builder.getInt32(0)}),
+        Builder.getInt64Ty(), "frame");
+    insertPoll(&*Position, Frame, StackLimit, StackSpan);
+    for (llvm::Instruction *BackEdge: BackEdges) {
+        insertPoll(BackEdge, Frame, StackLimit, StackSpan);
+    }
+
+    // The limit words belong to the runtime, like the buffers of its functions: inaccessible memory.
+    // PurityInferencePass and the declarations in callers already allow for the polls (see PureAttribute);
+    // this covers functions marked memory(none) some other way.
+    F.setMemoryEffects(F.getMemoryEffects() | llvm::MemoryEffects::inaccessibleMemOnly());
+}
+
+void InsertSafepoints(llvm::Module &M, uint64_t StackLimit, uint64_t StackSpan) {
+    for (llvm::Function &F: M) {
+        if (F.isDeclaration() == false) {
+            insertSafepoints(F, StackLimit, StackSpan);
+        }
+    }
+}
@@ -0,0 +1,16 @@
+#ifndef SAFEPOINT_H
+#define SAFEPOINT_H
+
+#include <cstdint>
+
+#include "llvm/IR/Module.h"
+
+// Poll the words at StackLimit and StackSpan (Runtime's kal_stack_limit and kal_stack_span) at the entry of
+// every function of M and on the back-edges of its loops: when the frame address is not within Span bytes
+// above Limit, kal_safepoint is called, which leaves the evaluation (see Runtime::evaluateWithLimits).
+// The JIT does this to generated modules as it compiles them, after optimization, so the polls keep no loop
+// from vectorizing. Purity inference knows of them beforehand: it gives pure functions inaccessible memory
+// effects instead of memory(none) (see PureAttribute). Imported LLVM IR is left alone.
+void InsertSafepoints(llvm::Module &M, uint64_t StackLimit, uint64_t StackSpan);
+
+#endif
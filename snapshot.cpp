@@ -0,0 +1,279 @@
+#include "snapshot.h"
+#include "codegen.h"
+#include "irimport.h"
+
+#include <cstring>
+
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+// Snapshot file layout (host byte order):
+//   magic, entry count, then per entry
+//   name, arguments (name, lanes), return lanes, purity flags, exported symbols (name, is function), bitcode size, padding to 8 bytes, bitcode
+// Externs have no symbols and an empty bitcode.
+static const char SnapshotMagic[] = "KALSNAP5";
+
+std::map<std::string, DefinitionRecord> Definitions;
+
+void RecordDefinition(const std::string &Name, const llvm::Module &M) {
+    DefinitionRecord Record;
+    for (const llvm::GlobalValue &GV: M.global_values()) {
+        if (GV.isDeclarationForLinker() == false and GV.hasLocalLinkage() == false) {
+            Record.Symbols.emplace_back(GV.getName().str(), llvm::isa<llvm::Function>(GV));
+        }
+    }
+
+    llvm::SmallVector<char, 0> Buffer;
+    llvm::raw_svector_ostream OS(Buffer);
+    llvm::WriteBitcodeToFile(M, OS);
+    Record.Storage = llvm::MemoryBuffer::getMemBufferCopy(llvm::StringRef(Buffer.data(), Buffer.size()), Name);
+    Record.Bitcode = Record.Storage->getBuffer();
+
+    Definitions[Name] = std::move(Record);
+}
+
+// Parses the bitcode of Record when the JIT first needs the definition Name
+static LazyModuleMaterializationUnit::ModuleLoader LoadDefinition(const std::string &Name,
+                                                                  const DefinitionRecord &Record) {
+    return [Bitcode = Record.Bitcode, Storage = Record.Storage, Name]()
+    -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+        auto Context = std::make_unique<llvm::LLVMContext>();
+        auto M = llvm::parseBitcodeFile(llvm::MemoryBufferRef(Bitcode, Name), *Context);
+        if (!M) {
+            return M.takeError();
+        }
+        return llvm::orc::ThreadSafeModule(std::move(*M), std::move(Context));
+    };
+}
+
+llvm::Error RestoreDefinitions() {
+    for (auto &[Name, Record]: Definitions) {
+        if (auto Error = TheJit->addLazyDefinition(Name, LoadDefinition(Name, Record))) {
+            return Error;
+        }
+    }
+    return llvm::Error::success();
+}
+
+namespace {
+    class SnapshotWriter {
+        llvm::raw_fd_ostream &OS;
+
+    public:
+        explicit SnapshotWriter(llvm::raw_fd_ostream &OS) : OS(OS) {
+        }
+
+        void writeInteger(uint64_t Value) {
+            OS.write(reinterpret_cast<const char *>(&Value), sizeof(Value));
+        }
+
+        void writeString(llvm::StringRef String) {
+            writeInteger(String.size());
+            OS << String;
+        }
+
+        void writeBlob(llvm::StringRef Blob) {
+            writeInteger(Blob.size());
+            while (OS.tell() % 8 != 0) {
+                OS << '\0';
+            }
+            OS << Blob;
+        }
+    };
+
+    class SnapshotReader {
+        llvm::StringRef Data;
+        size_t Offset = 0;
+
+    public:
+        explicit SnapshotReader(llvm::StringRef Data) : Data(Data) {
+        }
+
+        size_t offset() const { return Offset; }
+
+        bool readInteger(uint64_t &Value) {
+            if (Data.size() - Offset < sizeof(Value)) {
+                return false;
+            }
+            memcpy(&Value, Data.data() + Offset, sizeof(Value));
+            Offset += sizeof(Value);
+            return true;
+        }
+
+        bool readString(llvm::StringRef &String) {
+            uint64_t Size;
+            if (readInteger(Size) == false or Data.size() - Offset < Size) {
+                return false;
+            }
+            String = Data.substr(Offset, Size);
+            Offset += Size;
+            return true;
+        }
+
+        bool readBlob(llvm::StringRef &Blob) {
+            uint64_t Size;
+            if (readInteger(Size) == false) {
+                return false;
+            }
+            Offset = llvm::alignTo(Offset, 8);
+            if (Offset > Data.size() or Data.size() - Offset < Size) {
+                return false;
+            }
+            Blob = Data.substr(Offset, Size);
+            Offset += Size;
+            return true;
+        }
+    };
+}
+
+llvm::Error SaveSnapshot(const std::string &Path) {
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_None);
+    if (EC) {
+        return llvm::createFileError(Path, EC);
+    }
+
+    std::vector<const ASTNode::SignatureASTNode *> Entries;
+    for (auto &[Name, Signature]: Signatures) {
+        if (Name != "__anon_expr") {
+            Entries.push_back(Signature.get());
+        }
+    }
+
+    SnapshotWriter Writer(OS);
+    OS.write(SnapshotMagic, sizeof(SnapshotMagic) - 1);
+    Writer.writeInteger(Entries.size());
+    for (auto *Signature: Entries) {
+        Writer.writeString(Signature->getName());
+        Writer.writeInteger(Signature->getArguments().size());
+        for (size_t i = 0; i < Signature->getArguments().size(); ++i) {
+            Writer.writeString(Signature->getArguments()[i]);
+            Writer.writeInteger(Signature->getArgumentLanes()[i]);
+        }
+        Writer.writeInteger(Signature->getReturnLanes());
+        Writer.writeInteger((Signature->isPure() ? 1 : 0) | (Signature->alwaysReturns() ? 2 : 0) |
+                            (Signature->hasHiddenState() ? 4 : 0));
+
+        auto Record = Definitions.find(Signature->getName());
+        if (Record == Definitions.end()) {
+            Writer.writeInteger(0);
+            Writer.writeBlob("");
+            continue;
+        }
+        Writer.writeInteger(Record->second.Symbols.size());
+        for (auto &[Symbol, IsFunction]: Record->second.Symbols) {
+            Writer.writeString(Symbol);
+            Writer.writeInteger(IsFunction);
+        }
+        Writer.writeBlob(Record->second.Bitcode);
+    }
+
+    OS.close();
+    if (OS.has_error()) {
+        return llvm::createFileError(Path, OS.error());
+    }
+    return llvm::Error::success();
+}
+
+llvm::Error LoadSnapshot(const std::string &Path) {
+    // Not null terminated, so large snapshots are mapped instead of read
+    auto Buffer = llvm::MemoryBuffer::getFile(Path, false, false);
+    if (!Buffer) {
+        return llvm::createFileError(Path, Buffer.getError());
+    }
+    std::shared_ptr<const llvm::MemoryBuffer> Storage = std::move(*Buffer);
+
+    auto Truncated = [&]() {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "%s: truncated snapshot", Path.c_str());
+    };
+    // Lanes become vector types: a number (0) or vec2, vec4, vec8
+    auto ValidLanes = [](uint64_t Lanes) {
+        return Lanes == 0 or Lanes == 2 or Lanes == 4 or Lanes == 8;
+    };
+    auto InvalidLanes = [&](llvm::StringRef Name) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "%s: invalid vector type of %s",
+                                       Path.c_str(), Name.str().c_str());
+    };
+
+    llvm::StringRef Data = Storage->getBuffer();
+    if (Data.starts_with(llvm::StringRef(SnapshotMagic, sizeof(SnapshotMagic) - 1)) == false) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "%s: not a snapshot", Path.c_str());
+    }
+    SnapshotReader Reader(Data.drop_front(sizeof(SnapshotMagic) - 1));
+
+    uint64_t Count;
+    if (Reader.readInteger(Count) == false) {
+        return Truncated();
+    }
+    for (uint64_t Entry = 0; Entry < Count; ++Entry) {
+        llvm::StringRef Name;
+        uint64_t ArgumentCount;
+        if (Reader.readString(Name) == false or Reader.readInteger(ArgumentCount) == false) {
+            return Truncated();
+        }
+        std::vector<std::string> Arguments;
+        std::vector<unsigned int> ArgumentLanes;
+        for (uint64_t i = 0; i < ArgumentCount; ++i) {
+            llvm::StringRef Argument;
+            uint64_t Lanes;
+            if (Reader.readString(Argument) == false or Reader.readInteger(Lanes) == false) {
+                return Truncated();
+            }
+            if (ValidLanes(Lanes) == false) {
+                return InvalidLanes(Name);
+            }
+            Arguments.push_back(Argument.str());
+            ArgumentLanes.push_back(Lanes);
+        }
+        uint64_t ReturnLanes, Purity;
+        if (Reader.readInteger(ReturnLanes) == false or Reader.readInteger(Purity) == false) {
+            return Truncated();
+        }
+        if (ValidLanes(ReturnLanes) == false) {
+            return InvalidLanes(Name);
+        }
+
+        DefinitionRecord Record;
+        uint64_t SymbolCount;
+        if (Reader.readInteger(SymbolCount) == false) {
+            return Truncated();
+        }
+        for (uint64_t i = 0; i < SymbolCount; ++i) {
+            llvm::StringRef Symbol;
+            uint64_t IsFunction;
+            if (Reader.readString(Symbol) == false or Reader.readInteger(IsFunction) == false) {
+                return Truncated();
+            }
+            Record.Symbols.emplace_back(Symbol.str(), IsFunction != 0);
+        }
+        if (Reader.readBlob(Record.Bitcode) == false) {
+            return Truncated();
+        }
+
+        bool IsExtern = Record.Bitcode.empty();
+        if (IsExtern == false) {
+            if (TheJit->isDefined(Name.str()) or isImportedFunction(Name)) {
+                fprintf(stderr, "Error: cannot load %s: already defined in this session\n", Name.str().c_str());
+                continue;
+            }
+            Record.Storage = Storage;
+            auto Error = TheJit->addLazyDefinition(Name.str(), LoadDefinition(Name.str(), Record));
+            if (Error) {
+                fprintf(stderr, "Error: cannot load %s: %s\n", Name.str().c_str(),
+                        llvm::toString(std::move(Error)).c_str());
+                continue;
+            }
+            Definitions[Name.str()] = std::move(Record);
+        }
+        auto Signature = std::make_unique<ASTNode::SignatureASTNode>(Name.str(), std::move(Arguments),
+                                                                     std::move(ArgumentLanes), ReturnLanes);
+        Signature->setPurity((Purity & 1) != 0, (Purity & 2) != 0, (Purity & 4) != 0);
+        if (IsExtern) {
+            Signature->setExtern();
+        }
+        Signatures[Name.str()] = std::move(Signature);
+    }
+    return llvm::Error::success();
+}
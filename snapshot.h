@@ -0,0 +1,36 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+// Everything needed to recreate a definition in another session
+struct DefinitionRecord {
+    std::vector<std::pair<std::string, bool> > Symbols; // Exported symbols of the module (name, is function)
+    llvm::StringRef Bitcode; // Optimized module
+    std::shared_ptr<const llvm::MemoryBuffer> Storage; // Owner of Bitcode
+};
+
+extern std::map<std::string, DefinitionRecord> Definitions; // Definitions added to the JIT, by function name
+
+// Keep the bitcode of M, the module that defines function Name
+void RecordDefinition(const std::string &Name, const llvm::Module &M);
+
+// Add every recorded definition to a new JIT (see JIT::recreate); each one is only compiled when it is first used
+llvm::Error RestoreDefinitions();
+
+// Write every extern and definition of the session to Path
+llvm::Error SaveSnapshot(const std::string &Path);
+
+// Map Path and register its definitions; each one is only compiled when it is first used
+llvm::Error LoadSnapshot(const std::string &Path);
+
+#endif
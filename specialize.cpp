@@ -0,0 +1,291 @@
+// --specialize: argument value profiling, and versions of definitions specialized for stable arguments
+
+#include "specialize.h"
+#include "codegen.h"
+#include "profile.h"
+#include "snapshot.h"
+
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Linker/Linker.h"
+
+bool ArgumentSpecialization = false;
+
+static constexpr uint64_t MinProfiledCalls = 1000; // Calls seen before a definition is specialized
+static constexpr uint64_t MaxProfiledCalls = 1 << 20; // Profiling stops after this many calls without a stable argument
+static constexpr double StableFraction = 0.95; // Share of the calls an argument value needs
+static constexpr size_t MaxMeasuredArguments = 4; // :specializations times definitions with up to this many
+static constexpr double MeasureSeconds = 0.1; // per version
+
+// Calls of a definition going through kal_profile_arguments
+struct ArgumentProfile {
+    std::string Implementation; // f.N, called by the profiling entry
+    std::vector<unsigned int> Arguments; // Indices of the number arguments
+    std::unique_ptr<std::atomic<uint64_t>[]> Counters; // Layout of kal_profile_arguments
+};
+
+// A definition whose stub calls a guard: f.N.specialized if the arguments have the profiled values, else f.N
+struct Specialization {
+    std::string Implementation;
+    std::vector<std::pair<unsigned int, double> > Values; // Argument index and value
+    std::vector<double> Sample; // Typical number arguments, for measuring the speedup
+    std::unique_ptr<std::atomic<uint64_t>[]> Counters; // Hits, misses
+};
+
+static std::map<std::string, ArgumentProfile> Profiles;
+static std::map<std::string, Specialization> Specializations;
+
+static llvm::Value *getAddress(const void *Pointer) {
+    return Builder->CreateIntToPtr(Builder->getInt64(reinterpret_cast<uint64_t>(Pointer)), Builder->getPtrTy());
+}
+
+// Lossy like kal_profile_arguments: a plain load and store, atomic so that threads never tear the count
+static void emitIncrement(std::atomic<uint64_t> &Counter) {
+    llvm::Value *Address = getAddress(&Counter);
+    auto *Count = Builder->CreateAlignedLoad(Builder->getInt64Ty(), Address, llvm::Align(8));
+    Count->setAtomic(llvm::AtomicOrdering::Monotonic);
+    auto *Store = Builder->CreateAlignedStore(Builder->CreateAdd(Count, Builder->getInt64(1)), Address, llvm::Align(8));
+    Store->setAtomic(llvm::AtomicOrdering::Monotonic);
+}
+
+// Return Target called with the arguments of the function being generated. Caller and Target have the same
+// type, so the call must become a jump: the entry and the guard leave no frame on the stack of recursion.
+static void emitForward(llvm::Function *Caller, llvm::Function *Target) {
+    std::vector<llvm::Value *> Arguments;
+    for (llvm::Argument &Argument: Caller->args()) {
+        Arguments.push_back(&Argument);
+    }
+    auto *Call = Builder->CreateCall(Target, Arguments);
+    Call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+    Builder->CreateRet(Call);
+}
+
+// Hand TheModule to the JIT as the entry of Name and start a new module
+static void setEntry(const std::string &Name, const std::string &Entry) {
+    ExitOnErr(TheJit->setEntry(Name, llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext)),
+                               Entry));
+    InitializeModuleAndManagers();
+}
+
+void StartArgumentProfile(const std::string &Name) {
+    // Redefining Name has freed the entries of the previous version
+    Profiles.erase(Name);
+    Specializations.erase(Name);
+
+    const ASTNode::SignatureASTNode &Signature = *Signatures[Name];
+    ArgumentProfile Profile;
+    Profile.Implementation = TheJit->getImplementation(Name);
+    for (unsigned int i = 0; i < Signature.getArgumentLanes().size(); ++i) {
+        if (Signature.getArgumentLanes()[i] == 0) {
+            Profile.Arguments.push_back(i);
+        }
+    }
+    if (Profile.Arguments.empty()) {
+        return;
+    }
+    Profile.Counters = std::make_unique<std::atomic<uint64_t>[]>(1 + 3 * Profile.Arguments.size());
+
+    // f.N.profile(...): store the number arguments for kal_profile_arguments, then call f.N
+    llvm::Function *Version = Signatures[Name]->codegen();
+    Version->setName(Profile.Implementation);
+    std::string EntryName = Profile.Implementation + ".profile";
+    auto *Entry = llvm::Function::Create(Version->getFunctionType(), llvm::Function::ExternalLinkage, EntryName,
+                                         TheModule.get());
+    Builder->SetInsertPoint(llvm::BasicBlock::Create(*TheContext, "entry", Entry));
+
+    auto *ValuesType = llvm::ArrayType::get(Builder->getDoubleTy(), Profile.Arguments.size());
+    llvm::Value *Values = Builder->CreateAlloca(ValuesType, nullptr, "values");
+    for (unsigned int i = 0; i < Profile.Arguments.size(); ++i) {
+        Builder->CreateStore(Entry->getArg(Profile.Arguments[i]),
+                             Builder->CreateConstInBoundsGEP2_32(ValuesType, Values, 0, i));
+    }
+    llvm::FunctionCallee Record = TheModule->getOrInsertFunction(
+        "kal_profile_arguments", Builder->getVoidTy(), Builder->getPtrTy(), Builder->getPtrTy(),
+        Builder->getInt64Ty());
+    Builder->CreateCall(Record, {getAddress(Profile.Counters.get()), Values,
+                                 Builder->getInt64(Profile.Arguments.size())});
+    emitForward(Entry, Version);
+
+    setEntry(Name, EntryName);
+    Profiles[Name] = std::move(Profile);
+}
+
+// Add f.N.specialized, a copy of the definition's optimized module with Values substituted, and its guard,
+// and make the guard the entry of Name. false if the definition cannot be copied.
+static bool specialize(const std::string &Name, Specialization &S) {
+    auto Record = Definitions.find(Name);
+    if (Record == Definitions.end()) {
+        return false;
+    }
+    auto Parsed = llvm::parseBitcodeFile(llvm::MemoryBufferRef(Record->second.Bitcode, Name), *TheContext);
+    if (!Parsed) {
+        llvm::consumeError(Parsed.takeError());
+        return false;
+    }
+    // The memo table of a copy would be a second one
+    if ((*Parsed)->global_empty() == false) {
+        return false;
+    }
+    if (llvm::Linker::linkModules(*TheModule, std::move(*Parsed))) {
+        InitializeModuleAndManagers();
+        return false;
+    }
+
+    llvm::Function *Specialized = TheModule->getFunction(Name);
+    llvm::FunctionType *Type = Specialized->getFunctionType();
+    std::string GuardName = S.Implementation + ".guard";
+    auto *Guard = llvm::Function::Create(Type, llvm::Function::ExternalLinkage, GuardName, TheModule.get());
+    auto *Generic = llvm::Function::Create(Type, llvm::Function::ExternalLinkage, S.Implementation,
+                                           TheModule.get());
+
+    // Recursive calls may pass other values, so they go through the guard as well
+    Specialized->replaceAllUsesWith(Guard);
+    Specialized->setName(S.Implementation + ".specialized");
+    Specialized->setLinkage(llvm::Function::InternalLinkage);
+    for (auto &[Index, Value]: S.Values) {
+        Specialized->getArg(Index)->replaceAllUsesWith(llvm::ConstantFP::get(Builder->getDoubleTy(), Value));
+    }
+
+    auto *Entry = llvm::BasicBlock::Create(*TheContext, "entry", Guard);
+    auto *Hit = llvm::BasicBlock::Create(*TheContext, "hit", Guard);
+    auto *Miss = llvm::BasicBlock::Create(*TheContext, "miss", Guard);
+    Builder->SetInsertPoint(Entry);
+    llvm::Value *Matches = Builder->getTrue();
+    for (auto &[Index, Value]: S.Values) {
+        // Bits, like the profile: -0.0 is not 0.0, and a NaN matches itself
+        uint64_t Bits;
+        memcpy(&Bits, &Value, sizeof(Bits));
+        llvm::Value *Argument = Builder->CreateBitCast(Guard->getArg(Index), Builder->getInt64Ty());
+        Matches = Builder->CreateAnd(Matches, Builder->CreateICmpEQ(Argument, Builder->getInt64(Bits)));
+    }
+    Builder->CreateCondBr(Matches, Hit, Miss, llvm::MDBuilder(*TheContext).createBranchWeights(1000, 1));
+
+    S.Counters = std::make_unique<std::atomic<uint64_t>[]>(2);
+    Builder->SetInsertPoint(Hit);
+    emitIncrement(S.Counters[0]);
+    emitForward(Guard, Specialized);
+    Builder->SetInsertPoint(Miss);
+    emitIncrement(S.Counters[1]);
+    emitForward(Guard, Generic);
+
+    OptimizeModule(DefinitionOptimizationLevel);
+    setEntry(Name, GuardName);
+    return true;
+}
+
+// "n = 64.000000, mode = 1.000000"
+static std::string describeValues(const std::string &Name, const Specialization &S) {
+    const auto &Arguments = Signatures[Name]->getArguments();
+    std::string Values;
+    for (auto &[Index, Value]: S.Values) {
+        Values += (Values.empty() ? "" : ", ") + Arguments[Index] + " = " + std::to_string(Value);
+    }
+    return Values;
+}
+
+void SpecializeStableArguments() {
+    for (auto It = Profiles.begin(); It != Profiles.end();) {
+        auto &[Name, Profile] = *It;
+        uint64_t Calls = Profile.Counters[0].load(std::memory_order_relaxed);
+        if (Calls < MinProfiledCalls) {
+            ++It;
+            continue;
+        }
+
+        Specialization S;
+        S.Implementation = Profile.Implementation;
+        for (unsigned int i = 0; i < Profile.Arguments.size(); ++i) {
+            double Candidate;
+            uint64_t Bits = Profile.Counters[1 + 3 * i].load(std::memory_order_relaxed);
+            memcpy(&Candidate, &Bits, sizeof(Candidate));
+            S.Sample.push_back(Candidate);
+            if (Profile.Counters[3 + 3 * i].load(std::memory_order_relaxed) >= StableFraction * Calls) {
+                S.Values.emplace_back(Profile.Arguments[i], Candidate);
+            }
+        }
+        if (S.Values.empty() and Calls < MaxProfiledCalls) {
+            ++It;
+            continue;
+        }
+
+        if (S.Values.empty() or specialize(Name, S) == false) {
+            ExitOnErr(TheJit->clearEntry(Name)); // stop profiling
+        } else {
+            fprintf(stderr, "Specialized %s for %s\n", Name.c_str(), describeValues(Name, S).c_str());
+            Specializations[Name] = std::move(S);
+        }
+        It = Profiles.erase(It);
+    }
+}
+
+// A definition taking Arguments.size() numbers, at most MaxMeasuredArguments
+static double call(llvm::orc::ExecutorAddr Address, const std::vector<double> &Arguments) {
+    switch (Arguments.size()) {
+        case 0:
+            return Address.toPtr<double (*)()>()();
+        case 1:
+            return Address.toPtr<double (*)(double)>()(Arguments[0]);
+        case 2:
+            return Address.toPtr<double (*)(double, double)>()(Arguments[0], Arguments[1]);
+        case 3:
+            return Address.toPtr<double (*)(double, double, double)>()(Arguments[0], Arguments[1], Arguments[2]);
+        default:
+            return Address.toPtr<double (*)(double, double, double, double)>()(Arguments[0], Arguments[1],
+                                                                               Arguments[2], Arguments[3]);
+    }
+}
+
+// Median time of the guarded over the generic version, called with the profiled values; "" if the definition
+// cannot be called again safely (I/O, loops, recursion) or has vector or too many arguments
+static std::string measureSpeedup(const std::string &Name, Specialization &S) {
+    const ASTNode::SignatureASTNode &Signature = *Signatures[Name];
+    if (Signature.alwaysReturns() == false or Signature.hasVectors() or
+        Signature.getArguments().size() > MaxMeasuredArguments) {
+        return "";
+    }
+    auto Generic = TheJit->lookup(S.Implementation);
+    auto Guarded = TheJit->lookup(S.Implementation + ".guard");
+    if (!Generic or !Guarded) {
+        llvm::consumeError(Generic.takeError());
+        llvm::consumeError(Guarded.takeError());
+        return "";
+    }
+
+    // The measurement is not part of the hits
+    uint64_t Hits = S.Counters[0].load();
+    volatile double Sink;
+    auto Time = [&](llvm::orc::ExecutorAddr Address) {
+        return Benchmark([&] { Sink = call(Address, S.Sample); }, 0, MeasureSeconds).MedianNanoseconds;
+    };
+    double GenericTime = Time(Generic->getAddress());
+    double GuardedTime = Time(Guarded->getAddress());
+    S.Counters[0].store(Hits);
+    (void) Sink;
+
+    char Buffer[64];
+    snprintf(Buffer, sizeof(Buffer), ", %.2fx (%s -> %s)", GenericTime / GuardedTime,
+             FormatNanoseconds(GenericTime).c_str(), FormatNanoseconds(GuardedTime).c_str());
+    return Buffer;
+}
+
+void PrintSpecializations() {
+    if (ArgumentSpecialization == false) {
+        fprintf(stderr, "Argument profiling is off, start with --specialize\n");
+        return;
+    }
+    for (auto &[Name, Profile]: Profiles) {
+        fprintf(stderr, "%-20s profiling, %llu calls\n", Name.c_str(),
+                static_cast<unsigned long long>(Profile.Counters[0].load()));
+    }
+    for (auto &[Name, S]: Specializations) {
+        fprintf(stderr, "%-20s %s: %llu hits, %llu misses%s\n", Name.c_str(), describeValues(Name, S).c_str(),
+                static_cast<unsigned long long>(S.Counters[0].load()),
+                static_cast<unsigned long long>(S.Counters[1].load()), measureSpeedup(Name, S).c_str());
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef SPECIALIZE_H
+#define SPECIALIZE_H
+
+#include <string>
+
+extern bool ArgumentSpecialization; // --specialize
+
+// Record the number arguments of every call to the definition Name, just added to the JIT
+void StartArgumentProfile(const std::string &Name);
+
+// Give every profiled definition with arguments that (almost) never change a version specialized for their
+// values. Only between statements: it replaces code that must not be running.
+void SpecializeStableArguments();
+
+// :specializations
+void PrintSpecializations();
+
+#endif
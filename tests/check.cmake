@@ -0,0 +1,91 @@
+# Run a test script through main (stdin), in the directory of the script so that it can name the files next to it,
+# and match its output against the directives in its comments:
+#   # ARGS: --fp-mode=fast ...   options for main
+#   # CHECK: text                 must appear after the text of the previous CHECK
+#   # CHECK-NOT: text             must not appear anywhere
+#   # STDIN-LATER: seconds text   written to stdin that many seconds after the script (no ';')
+#   # OUTPUT-FILE: path           a file main writes, appended to its output for the checks
+#   # REQUIRES: regex             skip the test unless the host processor (x86_64, aarch64, ...) matches
+# %T in ARGS and OUTPUT-FILE is a directory of the test's own for such files.
+# cmake -DMAIN=<main> -DSCRIPT=<test.ks> [-DOUTPUT_DIRECTORY=<dir>] -P check.cmake
+
+file(STRINGS ${SCRIPT} Lines)
+get_filename_component(ScriptDirectory ${SCRIPT} DIRECTORY)
+if(NOT DEFINED OUTPUT_DIRECTORY)
+    get_filename_component(TestName ${SCRIPT} NAME_WE)
+    set(OUTPUT_DIRECTORY ${CMAKE_CURRENT_BINARY_DIR}/${TestName})
+endif()
+file(MAKE_DIRECTORY ${OUTPUT_DIRECTORY})
+set(Arguments "")
+set(Checks "")
+set(Forbidden "")
+set(LaterInput "")
+set(OutputFiles "")
+foreach(Line IN LISTS Lines)
+    string(REPLACE "%T" "${OUTPUT_DIRECTORY}" Line "${Line}")
+    if(Line MATCHES "^# ARGS: (.*)$")
+        separate_arguments(LineArguments UNIX_COMMAND "${CMAKE_MATCH_1}")
+        list(APPEND Arguments ${LineArguments})
+    elseif(Line MATCHES "^# CHECK: (.*)$")
+        list(APPEND Checks "${CMAKE_MATCH_1}")
+    elseif(Line MATCHES "^# CHECK-NOT: (.*)$")
+        list(APPEND Forbidden "${CMAKE_MATCH_1}")
+    elseif(Line MATCHES "^# STDIN-LATER: ([0-9.]+) (.*)$")
+        set(LaterDelay "${CMAKE_MATCH_1}")
+        set(LaterInput "${CMAKE_MATCH_2}")
+    elseif(Line MATCHES "^# OUTPUT-FILE: (.*)$")
+        list(APPEND OutputFiles "${CMAKE_MATCH_1}")
+    elseif(Line MATCHES "^# REQUIRES: (.*)$")
+        cmake_host_system_information(RESULT Processor QUERY OS_PLATFORM)
+        if(NOT Processor MATCHES "${CMAKE_MATCH_1}")
+            message(STATUS "Skipped: needs a ${CMAKE_MATCH_1} processor, not ${Processor}")
+            return()
+        endif()
+    endif()
+endforeach()
+
+if(LaterInput STREQUAL "")
+    execute_process(COMMAND ${MAIN} ${Arguments}
+            INPUT_FILE ${SCRIPT}
+            WORKING_DIRECTORY ${ScriptDirectory}
+            OUTPUT_VARIABLE Output
+            ERROR_VARIABLE Output
+            RESULT_VARIABLE Result
+            TIMEOUT 300)
+else()
+    # stdin stays open after the script, as at a terminal, until the line comes
+    execute_process(COMMAND sh -c "cat \"$0\"; sleep $1; printf '%s\\n' \"$2\"" ${SCRIPT} ${LaterDelay} "${LaterInput}"
+            COMMAND ${MAIN} ${Arguments}
+            WORKING_DIRECTORY ${ScriptDirectory}
+            OUTPUT_VARIABLE Output
+            ERROR_VARIABLE Output
+            RESULT_VARIABLE Result
+            TIMEOUT 300)
+endif()
+if(NOT Result EQUAL 0)
+    message(FATAL_ERROR "main exited with ${Result}:\n${Output}")
+endif()
+foreach(File IN LISTS OutputFiles)
+    if(NOT EXISTS ${File})
+        message(FATAL_ERROR "main did not write ${File}:\n${Output}")
+    endif()
+    file(READ ${File} Contents)
+    string(APPEND Output "\n${Contents}")
+endforeach()
+
+set(Rest "${Output}")
+foreach(Check IN LISTS Checks)
+    string(FIND "${Rest}" "${Check}" Position)
+    if(Position EQUAL -1)
+        message(FATAL_ERROR "Expected '${Check}' after the previous check in:\n${Output}")
+    endif()
+    string(LENGTH "${Check}" Length)
+    math(EXPR Position "${Position} + ${Length}")
+    string(SUBSTRING "${Rest}" ${Position} -1 Rest)
+endforeach()
+foreach(Check IN LISTS Forbidden)
+    string(FIND "${Output}" "${Check}" Position)
+    if(NOT Position EQUAL -1)
+        message(FATAL_ERROR "Unexpected '${Check}' in:\n${Output}")
+    endif()
+endforeach()
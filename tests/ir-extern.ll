@@ -0,0 +1,6 @@
+; For tests/ir-import.ks: shift takes one argument, where the extern before :load-ir declares two
+
+define double @shift(double %x) {
+  %sum = fadd double %x, 1.000000e+00
+  ret double %sum
+}
@@ -0,0 +1,16 @@
+; Functions for tests/ir-import.ks: one that callers inline, one with state of its own that they must call
+
+@counter = internal global double 0.000000e+00
+
+define double @axpy(double %a, double %x, double %y) {
+  %product = fmul double %a, %x
+  %sum = fadd double %product, %y
+  ret double %sum
+}
+
+define double @count(double %step) {
+  %old = load double, ptr @counter
+  %new = fadd double %old, %step
+  store double %new, ptr @counter
+  ret double %new
+}
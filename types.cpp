@@ -0,0 +1,248 @@
+// Type inference: find the values that can be generated as i64 or i1 instead of double
+
+#include "ast.h"
+#include "codegen.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace ASTNode;
+
+// Every integer up to 2^53 is exact in a double, so i64 arithmetic below it gives the same results
+static constexpr double ExactLimit = 9007199254740992.0;
+
+static const VariableType DoubleType = {ValueKind::Double, 0, 0};
+static const VariableType BooleanType = {ValueKind::Boolean, 0, 1};
+
+static VariableType VectorType(unsigned int Lanes) {
+    return {ValueKind::Vector, 0, 0, Lanes};
+}
+
+// Booleans take part in integer arithmetic as 0 or 1
+static bool isIntegral(const VariableType &Type) {
+    return Type.Kind == ValueKind::Integer or Type.Kind == ValueKind::Boolean;
+}
+
+static bool isVector(const VariableType &Type) {
+    return Type.Kind == ValueKind::Vector;
+}
+
+static const char *const VectorBuiltins[] = {
+    "vec2", "vec4", "vec8", // vec4(x) splats, vec4(a, b, c, d) builds from lanes
+    "lane", "withlane", // lane(v, i), withlane(v, i, x)
+    "shuffle", // shuffle(a, b, i0, i1, ...): lanes of a then b picked by constant indices
+    "hsum", "hprod", "hmin", "hmax", // horizontal reductions
+    "printv", "outv", // like printd and outd, for every lane
+};
+
+bool ASTNode::isVectorBuiltin(const std::string &Name) {
+    for (const char *Builtin: VectorBuiltins) {
+        if (Name == Builtin) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static VariableType IntegerType(double Min, double Max, bool Assumed = false) {
+    if (Min < -ExactLimit or Max > ExactLimit) {
+        return DoubleType;
+    }
+    return {ValueKind::Integer, Min, Max, 0, Assumed};
+}
+
+static bool contains(const VariableType &Type, double Value) {
+    return Type.Min <= Value and Value <= Type.Max;
+}
+
+void NumberExpressionASTNode::inferTypes(TypeEnvironment &Environment) {
+    Type = std::trunc(value) == value ? IntegerType(value, value) : DoubleType;
+}
+
+void VariableExpressionASTNode::inferTypes(TypeEnvironment &Environment) {
+    auto Variable = Environment.find(Name);
+    Type = Variable == Environment.end() ? DoubleType : Variable->second;
+}
+
+void BinaryExpressionASTNode::inferTypes(TypeEnvironment &Environment) {
+    LHS->inferTypes(Environment);
+    RHS->inferTypes(Environment);
+
+    // Elementwise, with a number applied to every lane; '<' gives 0.0/1.0 lanes
+    if (isVector(LHS->getType()) or isVector(RHS->getType())) {
+        Type = VectorType(isVector(LHS->getType()) ? LHS->getType().Lanes : RHS->getType().Lanes);
+        return;
+    }
+
+    if (Operator == '<') {
+        Type = BooleanType;
+        return;
+    }
+
+    const VariableType &L = LHS->getType();
+    const VariableType &R = RHS->getType();
+    if (isIntegral(L) == false or isIntegral(R) == false) {
+        Type = DoubleType;
+        return;
+    }
+    bool Assumed = L.Assumed or R.Assumed;
+
+    switch (Operator) {
+        case '+':
+            Type = IntegerType(L.Min + R.Min, L.Max + R.Max, Assumed);
+            break;
+        case '-':
+            Type = IntegerType(L.Min - R.Max, L.Max - R.Min, Assumed);
+            break;
+        case '*': {
+            // 0 times a negative number is -0.0, which an i64 cannot hold
+            if ((contains(L, 0) and R.Min < 0) or (contains(R, 0) and L.Min < 0)) {
+                Type = DoubleType;
+                break;
+            }
+            double Products[] = {L.Min * R.Min, L.Min * R.Max, L.Max * R.Min, L.Max * R.Max};
+            Type = IntegerType(*std::min_element(std::begin(Products), std::end(Products)),
+                               *std::max_element(std::begin(Products), std::end(Products)), Assumed);
+            break;
+        }
+        default:
+            Type = DoubleType;
+            break;
+    }
+}
+
+void FunctionCallExpressionASTNode::inferTypes(TypeEnvironment &Environment) {
+    for (auto &Argument: Arguments) {
+        Argument->inferTypes(Environment);
+    }
+
+    Type = DoubleType;
+    if (Callee == "vec2" or Callee == "vec4" or Callee == "vec8") {
+        Type = VectorType(Callee[3] - '0');
+    } else if (Callee == "withlane") {
+        if (Arguments.empty() == false and isVector(Arguments[0]->getType())) {
+            Type = Arguments[0]->getType();
+        }
+    } else if (Callee == "shuffle") {
+        if (Arguments.size() > 2) {
+            Type = VectorType(Arguments.size() - 2);
+        }
+    } else if (isVectorBuiltin(Callee) == false) {
+        auto Signature = Signatures.find(Callee);
+        if (Signature != Signatures.end() and Signature->second->getReturnLanes() != 0) {
+            Type = VectorType(Signature->second->getReturnLanes());
+        }
+    }
+}
+
+void IfExpressionASTNode::inferTypes(TypeEnvironment &Environment) {
+    Condition->inferTypes(Environment);
+    Then->inferTypes(Environment);
+    Else->inferTypes(Environment);
+
+    const VariableType &T = Then->getType();
+    const VariableType &E = Else->getType();
+    if (isVector(T) or isVector(E)) {
+        Type = VectorType(isVector(T) ? T.Lanes : E.Lanes);
+    } else if (T.Kind == ValueKind::Boolean and E.Kind == ValueKind::Boolean) {
+        Type = BooleanType;
+    } else if (isIntegral(T) and isIntegral(E)) {
+        Type = IntegerType(std::min(T.Min, E.Min), std::max(T.Max, E.Max), T.Assumed or E.Assumed);
+    } else {
+        Type = DoubleType;
+    }
+}
+
+// Longer loops are assumed not to run: 2^40 iterations take over 15 minutes even at one per nanosecond
+static constexpr double MaxTripCount = 1099511627776.0;
+
+// While `Counter < E` holds, Counter <= max(E) - 1: the bound the end test keeps an increasing counter
+// below, or infinity. Types of End are inferred. Assumed is set when the range of E is only assumed.
+static double getUpperBound(const ExpressionASTNode &End, const std::string &Counter, bool &Assumed) {
+    auto *Compare = dynamic_cast<const BinaryExpressionASTNode *>(&End);
+    if (Compare == nullptr or Compare->getOperator() != '<' or isIntegral(Compare->getRHS().getType()) == false) {
+        return INFINITY;
+    }
+    auto *Variable = dynamic_cast<const VariableExpressionASTNode *>(&Compare->getLHS());
+    if (Variable == nullptr or Variable->getName() != Counter) {
+        return INFINITY;
+    }
+    Assumed = Compare->getRHS().getType().Assumed;
+    return Compare->getRHS().getType().Max - 1;
+}
+
+// While `E < Counter` holds, Counter >= min(E) + 1, or -infinity
+static double getLowerBound(const ExpressionASTNode &End, const std::string &Counter, bool &Assumed) {
+    auto *Compare = dynamic_cast<const BinaryExpressionASTNode *>(&End);
+    if (Compare == nullptr or Compare->getOperator() != '<' or isIntegral(Compare->getLHS().getType()) == false) {
+        return -INFINITY;
+    }
+    auto *Variable = dynamic_cast<const VariableExpressionASTNode *>(&Compare->getRHS());
+    if (Variable == nullptr or Variable->getName() != Counter) {
+        return -INFINITY;
+    }
+    Assumed = Compare->getLHS().getType().Assumed;
+    return Compare->getLHS().getType().Min + 1;
+}
+
+// The counter is an integer when it starts at one, moves by integer steps and stays within 2^53. Its range
+// comes from the end test (`i < n` or `n < i` with an integer n), else from at most MaxTripCount steps;
+// otherwise it is a double. The step after the last iteration is not used, so it may leave the range.
+// A range from MaxTripCount is not proven: the counter and arithmetic on it are Assumed, and wrap instead
+// of being marked nsw, so a loop that runs longer gives wrong numbers rather than undefined behavior.
+void ForExpressionASTNode::inferTypes(TypeEnvironment &Environment) {
+    Start->inferTypes(Environment);
+
+    auto Outer = Environment.find(VariableName);
+    bool Shadows = Outer != Environment.end();
+    VariableType OuterType = Shadows ? Outer->second : DoubleType;
+
+    const VariableType &StartType = Start->getType();
+    CounterKind = ValueKind::Double;
+    CounterAssumed = false;
+    VariableType CounterType = DoubleType;
+    if (isIntegral(StartType)) {
+        // The step may read the counter: assume it is an integer to see whether the step is one
+        Environment[VariableName] = {ValueKind::Integer, -ExactLimit, ExactLimit};
+        VariableType StepType = {ValueKind::Integer, 1, 1};
+        if (Step != nullptr) {
+            Step->inferTypes(Environment);
+            StepType = Step->getType();
+        }
+        if (isIntegral(StepType)) {
+            End->inferTypes(Environment);
+            double Min = StartType.Min, Max = StartType.Max;
+            bool Assumed = StartType.Assumed or StepType.Assumed;
+            if (StepType.Max > 0) {
+                bool BoundAssumed = false;
+                double Bound = getUpperBound(*End, VariableName, BoundAssumed) + StepType.Max;
+                double Steps = StartType.Max + StepType.Max * MaxTripCount;
+                Max = std::max(Max, std::min(Bound, Steps));
+                Assumed = Assumed or BoundAssumed or Steps < Bound;
+            }
+            if (StepType.Min < 0) {
+                bool BoundAssumed = false;
+                double Bound = getLowerBound(*End, VariableName, BoundAssumed) + StepType.Min;
+                double Steps = StartType.Min + StepType.Min * MaxTripCount;
+                Min = std::min(Min, std::max(Bound, Steps));
+                Assumed = Assumed or BoundAssumed or Steps > Bound;
+            }
+            CounterType = IntegerType(Min, Max, Assumed);
+            CounterKind = CounterType.Kind;
+            CounterAssumed = CounterType.Assumed;
+        }
+    }
+
+    Environment[VariableName] = CounterType;
+    if (Step != nullptr) {
+        Step->inferTypes(Environment);
+    }
+    End->inferTypes(Environment);
+    Body->inferTypes(Environment);
+
+    if (Shadows) {
+        Environment[VariableName] = OuterType;
+    } else {
+        Environment.erase(VariableName);
+    }
+    Type = DoubleType;
+}